@@ -0,0 +1,399 @@
+#include <pty.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "amm_std.h"
+
+#include "Serial/serial-reader.h"
+#include "Serial/transmit-scheduler.h"
+
+// End-to-end benchmark for amm_serial_bridge.
+//
+// Gives the bridge a PTY as its serial port and plays the MCU on the master
+// side: it announces its capabilities, subscribes to a benchmark node and
+// streams [AMM_Command] and [AMM_Render_Modification] lines back. The bench's
+// own DDS participant publishes the node and listens for what the bridge
+// forwards, so both directions are timed against one clock. For each simulated
+// baud rate it reports latency percentiles and the sustained message rate.
+
+using namespace AMM;
+using namespace std::chrono;
+
+typedef steady_clock Clock;
+
+const std::string benchNode = "BENCH_LATENCY";
+const std::string benchMap = "BENCH";
+const std::string pingCommand = "BENCH_PING ";
+const std::string renderType = "BENCH";
+const std::string configFile = "config/serial_bridge_bench_amm.xml";
+
+// values go through the bridge as text with six significant digits, so
+// sequence numbers stay below a million
+const uint32_t kSequenceSpace = 1000000;
+
+const std::string capabilities =
+   "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+   "<AMMModuleConfiguration><module name=\"BENCH\" manufacturer=\"AMM\" model=\"BENCH\""
+   " serial_number=\"0\" module_version=\"1.0.0\"><capabilities><capability name=\"bench\">"
+   "<subscribed_topics><topic name=\"AMM_Node_Data\" nodepath=\"" + benchNode + "\" map_name=\"" + benchMap + "\"/>"
+   "</subscribed_topics><published_topics><topic name=\"AMM_Command\"/>"
+   "<topic name=\"AMM_Render_Modification\"/></published_topics>"
+   "</capability></capabilities></module></AMMModuleConfiguration>\n";
+
+int64_t nowNs() {
+   return duration_cast<nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Send timestamps by sequence number and the latencies measured against them.
+class LatencyRecorder {
+public:
+   LatencyRecorder() : m_sent(new std::atomic<int64_t>[kSequenceSpace]) {
+      reset();
+   }
+
+   void reset() {
+      for (uint32_t i = 0; i < kSequenceSpace; ++i) {
+         m_sent[i].store(0, std::memory_order_relaxed);
+      }
+      m_received = 0;
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_samples.clear();
+   }
+
+   void sent(uint32_t seq) {
+      m_sent[seq % kSequenceSpace].store(nowNs(), std::memory_order_release);
+   }
+
+   void received(uint32_t seq) {
+      int64_t sent = m_sent[seq % kSequenceSpace].exchange(0, std::memory_order_acq_rel);
+      ++m_received;
+      if (sent) {
+         std::lock_guard<std::mutex> guard(m_lock);
+         m_samples.push_back((nowNs() - sent) / 1000.0);
+      }
+   }
+
+   uint64_t count() const {
+      return m_received.load();
+   }
+
+   void report(const char *label) {
+      std::lock_guard<std::mutex> guard(m_lock);
+      if (m_samples.empty()) {
+         printf("  %-22s no samples\n", label);
+         return;
+      }
+      std::sort(m_samples.begin(), m_samples.end());
+      printf("  %-22s n=%-6zu p50=%9.1fus p99=%9.1fus p999=%9.1fus max=%9.1fus\n", label, m_samples.size(),
+             percentile(0.50), percentile(0.99), percentile(0.999), m_samples.back());
+   }
+
+private:
+   double percentile(double p) const {
+      size_t i = static_cast<size_t>(p * (m_samples.size() - 1));
+      return m_samples[i];
+   }
+
+   std::unique_ptr<std::atomic<int64_t>[]> m_sent;
+   std::atomic<uint64_t> m_received{0};
+   std::mutex m_lock;
+   std::vector<double> m_samples;
+};
+
+LatencyRecorder toSerial;
+LatencyRecorder fromSerial;
+
+class BenchListener : public ListenerInterface {
+public:
+    void onNewCommand(AMM::Command &c, eprosima::fastrtps::SampleInfo_t *info) {
+       if (!c.message().compare(0, pingCommand.size(), pingCommand)) {
+          fromSerial.received(static_cast<uint32_t>(strtoul(c.message().c_str() + pingCommand.size(), nullptr, 10)));
+       }
+    }
+
+    void onNewRenderModification(AMM::RenderModification &rendMod, SampleInfo_t *info) {
+       if (rendMod.type() == renderType) {
+          fromSerial.received(static_cast<uint32_t>(strtoul(rendMod.data().c_str(), nullptr, 10)));
+       }
+    }
+};
+
+// The MCU side of the PTY.
+class McuEmulator {
+public:
+   bool open() {
+      char name[64];
+      if (openpty(&m_master, &m_slave, name, nullptr, nullptr) == -1) {
+         perror("openpty");
+         return false;
+      }
+      struct termios raw;
+      tcgetattr(m_slave, &raw);
+      cfmakeraw(&raw);
+      tcsetattr(m_slave, TCSANOW, &raw);
+      fcntl(m_master, F_SETFL, fcntl(m_master, F_GETFL) | O_NONBLOCK);
+      m_slaveName = name;
+      m_reader.attach(m_master);
+      return true;
+   }
+
+   const std::string &slaveName() const {
+      return m_slaveName;
+   }
+
+   // inbound traffic is paced to what the simulated UART could carry
+   void setBaud(int baud) {
+      m_scheduler.configure(baud, 0, microseconds(0));
+   }
+
+   void start() {
+      m_running = true;
+      m_thread = std::thread(&McuEmulator::run, this);
+   }
+
+   void stop() {
+      m_running = false;
+      if (m_thread.joinable()) {
+         m_thread.join();
+      }
+   }
+
+   void send(const std::string &line) {
+      Clock::time_point now = Clock::now();
+      while (!m_scheduler.admit(line.size(), now)) {
+         std::this_thread::sleep_for(m_scheduler.delay(line.size(), now));
+         now = Clock::now();
+      }
+      size_t off = 0;
+      while (off < line.size()) {
+         ssize_t n = write(m_master, line.data() + off, line.size() - off);
+         if (n > 0) {
+            off += n;
+         } else {
+            struct pollfd pfd = {m_master, POLLOUT, 0};
+            poll(&pfd, 1, 10);
+         }
+      }
+   }
+
+   uint64_t linesReceived() const {
+      return m_lines.load();
+   }
+
+private:
+   void run() {
+      const std::string prefix = "[" + benchMap + "]";
+      std::string_view line;
+      while (m_running) {
+         if (m_reader.wait(50) <= 0) {
+            continue;
+         }
+         m_reader.fill();
+         while (m_reader.nextLine(line)) {
+            ++m_lines;
+            if (!line.compare(0, prefix.size(), prefix)) {
+               toSerial.received(static_cast<uint32_t>(strtoul(std::string(line.substr(prefix.size())).c_str(), nullptr, 10)));
+            }
+         }
+      }
+   }
+
+   int m_master = -1;
+   int m_slave = -1;
+   std::string m_slaveName;
+   SerialReader m_reader;
+   TransmitScheduler m_scheduler;
+   std::thread m_thread;
+   std::atomic<bool> m_running{false};
+   std::atomic<uint64_t> m_lines{0};
+};
+
+pid_t startBridge(const std::string &bridge, const std::string &port, int baud, int &stdinPipe) {
+   // the bridge reads commands from stdin; give it a pipe that stays quiet
+   int fds[2];
+   if (pipe(fds) == -1) {
+      return -1;
+   }
+   pid_t pid = fork();
+   if (pid == 0) {
+      dup2(fds[0], STDIN_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      std::string baudArg = std::to_string(baud);
+      execl(bridge.c_str(), bridge.c_str(), "-p", port.c_str(), "-b", baudArg.c_str(), (char *) nullptr);
+      perror("exec amm_serial_bridge");
+      _exit(127);
+   }
+   close(fds[0]);
+   stdinPipe = fds[1];
+   return pid;
+}
+
+void stopBridge(pid_t pid, int stdinPipe) {
+   kill(pid, SIGTERM);
+   waitpid(pid, nullptr, 0);
+   close(stdinPipe);
+}
+
+static void show_usage(const std::string &name) {
+   std::cerr << "Usage: " << name << " <option(s)>"
+             << "\nOptions:\n" << std::endl
+             << "\t-x Path to amm_serial_bridge (defaults to ./amm_serial_bridge)" << std::endl
+             << "\t-b Simulated baud rate, repeat for several (defaults to 115200 230400 460800 921600)" << std::endl
+             << "\t-n Latency samples per direction (defaults to 2000)" << std::endl
+             << "\t-r Latency sample rate in messages/s (defaults to 200)" << std::endl
+             << "\t-d Duration of each throughput run in seconds (defaults to 5)" << std::endl
+             << "\t-h,--help\t\tShow this help message\n"
+             << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+   static plog::ColorConsoleAppender<plog::TxtFormatter> consoleAppender;
+   plog::init(plog::warning, &consoleAppender);
+
+   std::string bridge = "./amm_serial_bridge";
+   std::vector<int> bauds;
+   int samples = 2000;
+   int sampleRate = 200;
+   int floodSeconds = 5;
+
+   for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if ((arg == "-h") || (arg == "--help")) {
+         show_usage(argv[0]);
+         return 0;
+      }
+      if (i + 1 >= argc) {
+         std::cerr << arg << " option requires one argument." << std::endl;
+         return 1;
+      }
+      if (arg == "-x") {
+         bridge = argv[++i];
+      } else if (arg == "-b") {
+         bauds.push_back(std::stoi(argv[++i]));
+      } else if (arg == "-n") {
+         samples = std::stoi(argv[++i]);
+      } else if (arg == "-r") {
+         sampleRate = std::stoi(argv[++i]);
+      } else if (arg == "-d") {
+         floodSeconds = std::stoi(argv[++i]);
+      }
+   }
+   if (bauds.empty()) {
+      bauds = {115200, 230400, 460800, 921600};
+   }
+
+   AMM::DDSManager<BenchListener> *mgr = new AMM::DDSManager<BenchListener>(configFile);
+   mgr->InitializePhysiologyValue();
+   mgr->InitializeCommand();
+   mgr->InitializeRenderModification();
+   mgr->CreatePhysiologyValuePublisher();
+
+   BenchListener listener;
+   mgr->CreateCommandSubscriber(&listener, &BenchListener::onNewCommand);
+   mgr->CreateRenderModificationSubscriber(&listener, &BenchListener::onNewRenderModification);
+
+   McuEmulator mcu;
+   if (!mcu.open()) {
+      return 1;
+   }
+   mcu.start();
+
+   uint32_t seq = 0;
+   AMM::PhysiologyValue value;
+   value.name(benchNode);
+
+   for (int baud : bauds) {
+      printf("baud %d\n", baud);
+      mcu.setBaud(baud);
+      int stdinPipe = -1;
+      pid_t pid = startBridge(bridge, mcu.slaveName(), baud, stdinPipe);
+      if (pid < 0) {
+         return 1;
+      }
+
+      // announce ourselves until the bridge routes the benchmark node to us
+      toSerial.reset();
+      fromSerial.reset();
+      Clock::time_point deadline = Clock::now() + seconds(20);
+      while (toSerial.count() == 0 && Clock::now() < deadline) {
+         mcu.send(capabilities);
+         for (int i = 0; i < 10 && toSerial.count() == 0; ++i) {
+            value.value(seq++ % kSequenceSpace);
+            mgr->WritePhysiologyValue(value);
+            std::this_thread::sleep_for(milliseconds(100));
+         }
+      }
+      if (toSerial.count() == 0) {
+         printf("  bridge never forwarded the benchmark node, skipping\n");
+         stopBridge(pid, stdinPipe);
+         continue;
+      }
+
+      // latency at a fixed rate that the link can carry comfortably
+      toSerial.reset();
+      fromSerial.reset();
+      microseconds interval(1000000 / std::max(sampleRate, 1));
+      for (int i = 0; i < samples; ++i) {
+         uint32_t s = seq++ % kSequenceSpace;
+         toSerial.sent(s);
+         value.value(s);
+         mgr->WritePhysiologyValue(value);
+
+         s = seq++ % kSequenceSpace;
+         fromSerial.sent(s);
+         if (i % 2) {
+            mcu.send("[AMM_Command]" + pingCommand + std::to_string(s) + "\n");
+         } else {
+            mcu.send("[AMM_Render_Modification]type=" + renderType + ";payload=" + std::to_string(s) + "\n");
+         }
+         std::this_thread::sleep_for(interval);
+      }
+      std::this_thread::sleep_for(milliseconds(500));
+      toSerial.report("DDS -> serial");
+      fromSerial.report("serial -> DDS");
+
+      // sustained rate: flood one direction at a time and count what arrives
+      uint64_t before = toSerial.count();
+      Clock::time_point end = Clock::now() + seconds(floodSeconds);
+      uint64_t published = 0;
+      while (Clock::now() < end) {
+         value.value(seq++ % kSequenceSpace);
+         mgr->WritePhysiologyValue(value);
+         ++published;
+      }
+      std::this_thread::sleep_for(milliseconds(500));
+      printf("  %-22s %.0f msg/s (%llu published)\n", "DDS -> serial max",
+             (toSerial.count() - before) / static_cast<double>(floodSeconds),
+             static_cast<unsigned long long>(published));
+
+      fromSerial.reset();
+      end = Clock::now() + seconds(floodSeconds);
+      while (Clock::now() < end) {
+         mcu.send("[AMM_Command]" + pingCommand + std::to_string(seq++ % kSequenceSpace) + "\n");
+      }
+      std::this_thread::sleep_for(milliseconds(500));
+      printf("  %-22s %.0f msg/s\n", "serial -> DDS max", fromSerial.count() / static_cast<double>(floodSeconds));
+
+      stopBridge(pid, stdinPipe);
+   }
+
+   mcu.stop();
+   return 0;
+}
@@ -0,0 +1,146 @@
+#ifndef AMM_MODULES_BAUD_NEGOTIATOR_H
+#define AMM_MODULES_BAUD_NEGOTIATOR_H
+
+#include <chrono>
+#include <string>
+
+// Steps the line speed of one port up to the fastest rate both ends confirm.
+//
+// The port opens at the -b rate. For each faster rate in kRates up to the
+// bridge's maximum, the bridge sends [BAUD]propose=<rate>. An MCU that can run
+// at it answers [BAUD]accept=<rate> at the old rate and switches; otherwise
+// it answers [BAUD]reject=<rate>. The bridge then switches too and sends
+// [BAUD]confirm=<rate> at the new rate, which the MCU answers with
+// [BAUD]confirmed=<rate>. If that answer does not arrive within kTimeout,
+// both ends fall back to the last confirmed rate and negotiation ends; the
+// MCU does the same when no confirm reaches it.
+//
+// MCUs negotiate before sending their capabilities. The first proposal is
+// repeated for a while so an MCU that resets when the port opens can catch
+// it; one that never answers is left at the -b rate. Only the reactor shard
+// that owns the port calls into a negotiator.
+class BaudNegotiator {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   static constexpr int kRates[] = {
+      230400, 460800, 500000, 576000, 921600, 1000000, 1500000, 2000000, 3000000, 4000000
+   };
+   static constexpr std::chrono::milliseconds kTimeout{500};
+   static const int kFirstAttempts = 10;
+
+   // What the session has to do next: switch the port to baud if it is not
+   // 0, then send line if it is not empty.
+   struct Step {
+      int baud = 0;
+      std::string line;
+   };
+
+   void start(int current, int max, Clock::time_point now) {
+      m_good = current;
+      m_max = max;
+      m_attempts = 0;
+      m_answered = false;
+      propose(now);
+   }
+
+   bool active() const {
+      return m_state != State::DONE;
+   }
+
+   // when tick() next has something to do
+   Clock::time_point deadline() const {
+      return active() ? m_deadline : Clock::time_point::max();
+   }
+
+   // the last rate both ends confirmed
+   int rate() const {
+      return m_good;
+   }
+
+   // Retries or abandons a step that went unanswered. returns true if step
+   // has something to do.
+   bool tick(Clock::time_point now, Step &step) {
+      if (m_state == State::DONE || now < m_deadline) {
+         return false;
+      }
+      if (m_state == State::PROPOSING) {
+         if (m_answered || m_attempts >= kFirstAttempts) {
+            m_state = State::DONE;
+            return false;
+         }
+         return send(now, step);
+      }
+      // no confirmation at the new rate, go back to the last one that worked
+      m_state = State::DONE;
+      step.baud = m_good;
+      return true;
+   }
+
+   // [BAUD]accept=<rate>
+   bool accepted(int rate, Clock::time_point now, Step &step) {
+      if (m_state != State::PROPOSING || rate != m_candidate) {
+         return false;
+      }
+      m_answered = true;
+      m_state = State::CONFIRMING;
+      m_deadline = now + kTimeout;
+      step.baud = rate;
+      step.line = "[BAUD]confirm=" + std::to_string(rate) + "\n";
+      return true;
+   }
+
+   // [BAUD]reject=<rate>
+   void rejected(int rate) {
+      if (m_state == State::PROPOSING && rate == m_candidate) {
+         m_state = State::DONE;
+      }
+   }
+
+   // [BAUD]confirmed=<rate>
+   bool confirmed(int rate, Clock::time_point now, Step &step) {
+      if (m_state != State::CONFIRMING || rate != m_candidate) {
+         return false;
+      }
+      m_good = rate;
+      propose(now);
+      return active() && send(now, step);
+   }
+
+private:
+   enum class State {
+      PROPOSING,
+      CONFIRMING,
+      DONE
+   };
+
+   // picks the next rate to try, if any
+   void propose(Clock::time_point now) {
+      m_candidate = 0;
+      for (int rate : kRates) {
+         if (rate > m_good && rate <= m_max) {
+            m_candidate = rate;
+            break;
+         }
+      }
+      m_state = m_candidate ? State::PROPOSING : State::DONE;
+      m_deadline = now;
+   }
+
+   bool send(Clock::time_point now, Step &step) {
+      ++m_attempts;
+      m_deadline = now + kTimeout;
+      step.line = "[BAUD]propose=" + std::to_string(m_candidate) + "\n";
+      return true;
+   }
+
+   State m_state = State::DONE;
+   int m_good = 0;
+   int m_max = 0;
+   int m_candidate = 0;
+   int m_attempts = 0;
+   bool m_answered = false;
+   Clock::time_point m_deadline;
+};
+
+#endif //AMM_MODULES_BAUD_NEGOTIATOR_H
@@ -0,0 +1,203 @@
+#ifndef AMM_MODULES_BINARY_PROTOCOL_H
+#define AMM_MODULES_BINARY_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "frame-pool.h"
+#include "waveform.h"
+
+// Optional binary wire protocol, negotiated by the MCU with
+// wire_protocol="binary" on the <module> of its AMMModuleConfiguration.
+//
+// Every packet is   type:u8 | body | crc16:u16le
+// COBS-encoded and terminated by a single 0x00. The CRC is CRC-16/CCITT-FALSE
+// over type and body. Multi-byte fields are little-endian.
+//
+//   TEXT       body is one text protocol line without its newline
+//   VALUE_F64  topic id:u16 | value:f64
+//   VALUE_F32  topic id:u16 | value:f32
+//   WAVEFORM   topic id:u16 | start us:u32 | interval us:u32 | count:u8 | count x f32
+//
+// Numeric values travel as VALUE packets; everything else is carried in TEXT
+// packets so the existing text handlers apply unchanged.
+namespace BinaryProtocol {
+
+   enum PacketType : uint8_t {
+      TEXT = 0x01,
+      VALUE_F64 = 0x02,
+      VALUE_F32 = 0x03,
+      WAVEFORM = 0x04
+   };
+
+   static const char kDelimiter = '\0';
+
+   inline uint16_t crc16(uint16_t crc, uint8_t byte) {
+      crc ^= static_cast<uint16_t>(byte) << 8;
+      for (int i = 0; i < 8; ++i) {
+         crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+      }
+      return crc;
+   }
+
+   // Streams a packet into out, COBS-encoding on the fly so no intermediate
+   // buffer is needed.
+   class PacketWriter {
+   public:
+      PacketWriter(std::string &out, PacketType type) : m_out(out) {
+         open();
+         put(type);
+      }
+
+      void put(uint8_t byte) {
+         m_crc = crc16(m_crc, byte);
+         encode(byte);
+      }
+
+      void put(const char *data, size_t len) {
+         for (size_t i = 0; i < len; ++i) {
+            put(static_cast<uint8_t>(data[i]));
+         }
+      }
+
+      void put16(uint16_t value) {
+         put(static_cast<uint8_t>(value));
+         put(static_cast<uint8_t>(value >> 8));
+      }
+
+      void put32(uint32_t value) {
+         for (int i = 0; i < 4; ++i) {
+            put(static_cast<uint8_t>(value >> (8 * i)));
+         }
+      }
+
+      void put64(uint64_t value) {
+         for (int i = 0; i < 8; ++i) {
+            put(static_cast<uint8_t>(value >> (8 * i)));
+         }
+      }
+
+      void finish() {
+         uint16_t crc = m_crc;
+         encode(static_cast<uint8_t>(crc));
+         encode(static_cast<uint8_t>(crc >> 8));
+         close();
+         m_out.push_back(kDelimiter);
+      }
+
+   private:
+      void open() {
+         m_codePos = m_out.size();
+         m_out.push_back(0);
+         m_code = 1;
+      }
+
+      void close() {
+         m_out[m_codePos] = static_cast<char>(m_code);
+      }
+
+      void encode(uint8_t byte) {
+         if (byte == 0) {
+            close();
+            open();
+            return;
+         }
+         m_out.push_back(static_cast<char>(byte));
+         if (++m_code == 0xFF) {
+            close();
+            open();
+         }
+      }
+
+      std::string &m_out;
+      size_t m_codePos = 0;
+      uint8_t m_code = 1;
+      uint16_t m_crc = 0xFFFF;
+   };
+
+   // Decodes one COBS frame (without its 0x00 delimiter) into type and body
+   // and checks its CRC. returns false for malformed or corrupted frames.
+   inline bool decode(const char *data, size_t len, std::string &packet) {
+      packet.clear();
+      size_t i = 0;
+      while (i < len) {
+         uint8_t code = static_cast<uint8_t>(data[i++]);
+         if (code == 0) {
+            return false;
+         }
+         for (uint8_t j = 1; j < code; ++j) {
+            if (i >= len) {
+               return false;
+            }
+            packet.push_back(data[i++]);
+         }
+         if (code < 0xFF && i < len) {
+            packet.push_back(0);
+         }
+      }
+      if (packet.size() < 3) {
+         return false;
+      }
+
+      size_t bodyLen = packet.size() - 2;
+      uint16_t crc = 0xFFFF;
+      for (size_t k = 0; k < bodyLen; ++k) {
+         crc = crc16(crc, static_cast<uint8_t>(packet[k]));
+      }
+      uint16_t received = static_cast<uint8_t>(packet[bodyLen]) |
+                          (static_cast<uint16_t>(static_cast<uint8_t>(packet[bodyLen + 1])) << 8);
+      packet.resize(bodyLen);
+      return crc == received;
+   }
+
+   // VALUE packet for a subscribed topic
+   inline void value(Frame &frame, uint16_t topicId, double value, bool float32) {
+      PacketWriter packet(frame.data, float32 ? VALUE_F32 : VALUE_F64);
+      packet.put16(topicId);
+      if (float32) {
+         float narrow = static_cast<float>(value);
+         uint32_t bits;
+         memcpy(&bits, &narrow, sizeof(bits));
+         packet.put32(bits);
+      } else {
+         uint64_t bits;
+         memcpy(&bits, &value, sizeof(bits));
+         packet.put64(bits);
+      }
+      packet.finish();
+   }
+
+   // WAVEFORM packet with a block of samples for an HF_ subscription
+   inline void waveform(Frame &frame, uint16_t topicId, const WaveformBlock &block) {
+      PacketWriter packet(frame.data, WAVEFORM);
+      packet.put16(topicId);
+      packet.put32(block.start);
+      packet.put32(block.interval);
+      packet.put(static_cast<uint8_t>(block.samples.size()));
+      for (float sample : block.samples) {
+         uint32_t bits;
+         memcpy(&bits, &sample, sizeof(bits));
+         packet.put32(bits);
+      }
+      packet.finish();
+   }
+
+   // Rewrites a frame holding a text protocol line as a TEXT packet. scratch
+   // trades buffers with the frame, so both keep their capacity.
+   inline void wrapText(Frame &frame, std::string &scratch) {
+      size_t len = frame.data.size();
+      if (len > 0 && frame.data[len - 1] == '\n') {
+         --len;
+      }
+      scratch.clear();
+      PacketWriter packet(scratch, TEXT);
+      packet.put(frame.data.data(), len);
+      packet.finish();
+      frame.data.swap(scratch);
+   }
+
+}
+
+#endif //AMM_MODULES_BINARY_PROTOCOL_H
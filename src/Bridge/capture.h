@@ -0,0 +1,334 @@
+#ifndef AMM_MODULES_CAPTURE_H
+#define AMM_MODULES_CAPTURE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <thread>
+
+// What a capture record holds. Serial records carry the bytes of one line
+// or frame; DDS records carry one sample as it entered the listener.
+enum class CaptureKind : uint8_t {
+   SERIAL_IN = 1,
+   SERIAL_OUT,
+   // name, then the value as a double
+   PHYSIOLOGY_VALUE,
+   PHYSIOLOGY_WAVEFORM,
+   // the message
+   COMMAND,
+   // type, then data
+   PHYSIOLOGY_MODIFICATION,
+   RENDER_MODIFICATION,
+   // the control type as an int32_t
+   SIMULATION_CONTROL
+};
+
+// On-disk layout, in host byte order. A capture is a CaptureHeader followed
+// by records, each a CaptureRecord and its payload, padded to 8 bytes. The
+// payload is split into a first field of split bytes and a second field with
+// the rest. length is stored last, so a record that was still being written
+// when the bridge died reads as the end of the capture.
+struct CaptureHeader {
+   char magic[8];
+   // wall clock at the start, in ns since the epoch
+   uint64_t started;
+};
+
+struct CaptureRecord {
+   // ns since the capture started, on the monotonic clock
+   uint64_t time;
+   // this header and the payload, without padding; 0 until complete
+   uint32_t length;
+   uint16_t split;
+   uint8_t kind;
+   // session index of serial records
+   uint8_t port;
+};
+
+static_assert(sizeof(CaptureHeader) == 16 && sizeof(CaptureRecord) == 16, "capture layout is fixed");
+
+static const char kCaptureMagic[8] = {'A', 'M', 'M', 'C', 'A', 'P', '0', '1'};
+
+// records start on 8 byte boundaries
+inline size_t captureStride(size_t length) {
+   return (length + 7) & ~size_t(7);
+}
+
+// Appends traffic to a preallocated, memory-mapped capture file.
+//
+// The file is sized up front and mapped with its pages populated, so
+// recording a record costs an atomic reservation and a memcpy: no syscall and
+// no page fault on the hot path. Any thread may append. When the file is full
+// further records are counted as dropped. close() waits for appends in
+// flight, then cuts the file down to what was written.
+class CaptureLog {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   ~CaptureLog() {
+      close();
+   }
+
+   // returns false with errno set if the file could not be created
+   bool open(const char *path, size_t capacity) {
+      capacity = std::max(capacity, sizeof(CaptureHeader));
+      m_fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (m_fd < 0) {
+         return false;
+      }
+      int err = posix_fallocate(m_fd, 0, capacity);
+      if (err != 0) {
+         ::close(m_fd);
+         m_fd = -1;
+         errno = err;
+         return false;
+      }
+      void *base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, 0);
+      if (base == MAP_FAILED) {
+         ::close(m_fd);
+         m_fd = -1;
+         return false;
+      }
+      m_base = static_cast<char *>(base);
+      m_capacity = capacity;
+
+      CaptureHeader header;
+      memcpy(header.magic, kCaptureMagic, sizeof(header.magic));
+      header.started = std::chrono::duration_cast<std::chrono::nanoseconds>(
+         std::chrono::system_clock::now().time_since_epoch()).count();
+      memcpy(m_base, &header, sizeof(header));
+      m_offset = sizeof(header);
+      m_start = Clock::now();
+      m_active.store(true, std::memory_order_release);
+      return true;
+   }
+
+   void close() {
+      if (!m_active.exchange(false)) {
+         return;
+      }
+      while (m_writers.load() != 0) {
+         std::this_thread::yield();
+      }
+      size_t used = std::min<size_t>(m_offset.load(), m_capacity);
+      munmap(m_base, m_capacity);
+      if (ftruncate(m_fd, used) != 0) {
+         // the rest reads as the end of the capture anyway
+      }
+      ::close(m_fd);
+      m_fd = -1;
+      m_base = nullptr;
+   }
+
+   bool active() const {
+      return m_active.load(std::memory_order_relaxed);
+   }
+
+   void serial(CaptureKind kind, uint8_t port, std::string_view data) {
+      append(kind, port, {}, data);
+   }
+
+   void number(CaptureKind kind, std::string_view name, double value) {
+      append(kind, 0, name, std::string_view(reinterpret_cast<const char *>(&value), sizeof(value)));
+   }
+
+   void text(CaptureKind kind, std::string_view first, std::string_view second = {}) {
+      append(kind, 0, first, second);
+   }
+
+   void control(int32_t type) {
+      append(CaptureKind::SIMULATION_CONTROL, 0, {}, std::string_view(reinterpret_cast<const char *>(&type), sizeof(type)));
+   }
+
+   uint64_t records() const {
+      return m_records.load(std::memory_order_relaxed);
+   }
+
+   // records that did not fit in the file
+   uint64_t dropped() const {
+      return m_dropped.load(std::memory_order_relaxed);
+   }
+
+   size_t bytes() const {
+      return std::min<size_t>(m_offset.load(std::memory_order_relaxed), m_capacity);
+   }
+
+private:
+   void append(CaptureKind kind, uint8_t port, std::string_view first, std::string_view second) {
+      // close() must not unmap under a writer; the counter and the flag are
+      // both sequentially consistent so one of the two sides sees the other
+      m_writers.fetch_add(1);
+      if (m_active.load()) {
+         first = first.substr(0, UINT16_MAX);
+         size_t length = sizeof(CaptureRecord) + first.size() + second.size();
+         size_t offset = m_offset.fetch_add(captureStride(length), std::memory_order_relaxed);
+         if (offset + length <= m_capacity) {
+            char *at = m_base + offset;
+            CaptureRecord *record = reinterpret_cast<CaptureRecord *>(at);
+            record->time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - m_start).count();
+            record->split = static_cast<uint16_t>(first.size());
+            record->kind = static_cast<uint8_t>(kind);
+            record->port = port;
+            std::copy(first.begin(), first.end(), at + sizeof(CaptureRecord));
+            std::copy(second.begin(), second.end(), at + sizeof(CaptureRecord) + first.size());
+            __atomic_store_n(&record->length, static_cast<uint32_t>(length), __ATOMIC_RELEASE);
+            m_records.fetch_add(1, std::memory_order_relaxed);
+         } else {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+         }
+      }
+      m_writers.fetch_sub(1);
+   }
+
+   int m_fd = -1;
+   char *m_base = nullptr;
+   size_t m_capacity = 0;
+   Clock::time_point m_start;
+   std::atomic<size_t> m_offset{0};
+   std::atomic<bool> m_active{false};
+   std::atomic<int> m_writers{0};
+   std::atomic<uint64_t> m_records{0};
+   std::atomic<uint64_t> m_dropped{0};
+};
+
+// Plays a capture back on its original timeline, scaled by a speed factor,
+// or as fast as it can be read.
+class CaptureReplay {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   struct Record {
+      CaptureKind kind;
+      uint8_t port;
+      std::chrono::nanoseconds time;
+      std::string_view first;
+      std::string_view second;
+
+      double number() const {
+         double value = 0;
+         memcpy(&value, second.data(), std::min(second.size(), sizeof(value)));
+         return value;
+      }
+
+      int32_t control() const {
+         int32_t type = 0;
+         memcpy(&type, second.data(), std::min(second.size(), sizeof(type)));
+         return type;
+      }
+   };
+
+   ~CaptureReplay() {
+      if (m_base) {
+         munmap(const_cast<char *>(m_base), m_size);
+      }
+   }
+
+   // returns false if path is not a readable capture
+   bool open(const char *path) {
+      int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+         return false;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CaptureHeader)) {
+         ::close(fd);
+         return false;
+      }
+      void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (base == MAP_FAILED) {
+         return false;
+      }
+      m_base = static_cast<const char *>(base);
+      m_size = st.st_size;
+      madvise(base, m_size, MADV_SEQUENTIAL);
+      if (memcmp(m_base, kCaptureMagic, sizeof(kCaptureMagic)) != 0) {
+         return false;
+      }
+      m_offset = sizeof(CaptureHeader);
+      return true;
+   }
+
+   // speed 1 replays in real time, 0 as fast as possible
+   void start(double speed, Clock::time_point now) {
+      m_speed = speed;
+      m_start = now;
+   }
+
+   // Takes the next record if it is due at now.
+   bool next(Clock::time_point now, Record &record) {
+      if (!peek(record) || now < due(record)) {
+         return false;
+      }
+      m_offset += captureStride(length());
+      ++m_played;
+      return true;
+   }
+
+   // when the next record is due, max once the capture is exhausted
+   Clock::time_point nextDue() {
+      Record record;
+      return peek(record) ? due(record) : Clock::time_point::max();
+   }
+
+   bool finished() {
+      Record record;
+      return !peek(record);
+   }
+
+   uint64_t played() const {
+      return m_played;
+   }
+
+private:
+   uint32_t length() const {
+      const CaptureRecord *header = reinterpret_cast<const CaptureRecord *>(m_base + m_offset);
+      return header->length;
+   }
+
+   bool peek(Record &record) const {
+      if (m_size - m_offset < sizeof(CaptureRecord)) {
+         return false;
+      }
+      const CaptureRecord *header = reinterpret_cast<const CaptureRecord *>(m_base + m_offset);
+      uint32_t length = header->length;
+      if (length < sizeof(CaptureRecord) || length > m_size - m_offset ||
+          header->split > length - sizeof(CaptureRecord)) {
+         return false;
+      }
+      const char *payload = m_base + m_offset + sizeof(CaptureRecord);
+      size_t size = length - sizeof(CaptureRecord);
+      record.kind = static_cast<CaptureKind>(header->kind);
+      record.port = header->port;
+      record.time = std::chrono::nanoseconds(header->time);
+      record.first = std::string_view(payload, header->split);
+      record.second = std::string_view(payload + header->split, size - header->split);
+      return true;
+   }
+
+   Clock::time_point due(const Record &record) const {
+      if (m_speed <= 0) {
+         return m_start;
+      }
+      return m_start + std::chrono::duration_cast<Clock::duration>(
+         std::chrono::duration<double, std::nano>(record.time.count() / m_speed));
+   }
+
+   const char *m_base = nullptr;
+   size_t m_size = 0;
+   size_t m_offset = 0;
+   double m_speed = 1;
+   Clock::time_point m_start;
+   uint64_t m_played = 0;
+};
+
+#endif //AMM_MODULES_CAPTURE_H
@@ -0,0 +1,154 @@
+#ifndef AMM_MODULES_CONFIG_CACHE_H
+#define AMM_MODULES_CONFIG_CACHE_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// One static configuration file, read into memory and split into the lines
+// that go to the MCU. The content is owned, so a transfer that holds on to it
+// is unaffected by later edits to the file.
+struct ConfigFile {
+   ConfigFile() = default;
+   ConfigFile(const ConfigFile &) = delete;
+   ConfigFile &operator=(const ConfigFile &) = delete;
+
+   std::string data;
+   // what the file looked like when it was read
+   ino_t inode = 0;
+   off_t size = 0;
+   struct timespec modified = {};
+   // views into data, without their newline
+   std::vector<std::string_view> lines;
+
+   bool matches(const struct stat &st) const {
+      return st.st_ino == inode && st.st_size == size && st.st_mtim.tv_sec == modified.tv_sec &&
+             st.st_mtim.tv_nsec == modified.tv_nsec;
+   }
+};
+
+// Index of static/module_configuration_static, built once at startup.
+//
+// Every <SCENE>_<MODULE>.txt is read and split into lines up front, so a
+// [SYS]CONFIG= command costs a hash lookup and a stat() instead of a file
+// read and a split. A file that was edited, replaced or removed since it was
+// read is picked up on the next request, and one that only appears after
+// startup is read on first request.
+class ConfigCache {
+public:
+   static constexpr const char *kDefaultDirectory = "static/module_configuration_static/";
+   static constexpr const char *kExtension = ".txt";
+
+   explicit ConfigCache(const std::string &directory = kDefaultDirectory) : m_directory(directory) {
+      if (!m_directory.empty() && m_directory.back() != '/') {
+         m_directory += '/';
+      }
+   }
+
+   // reads every config file in the directory; returns how many were loaded
+   size_t load() {
+      DIR *dir = opendir(m_directory.c_str());
+      if (!dir) {
+         return 0;
+      }
+      std::lock_guard<std::mutex> guard(m_lock);
+      size_t extension = strlen(kExtension);
+      while (struct dirent *entry = readdir(dir)) {
+         std::string name = entry->d_name;
+         if (name.size() <= extension || name.compare(name.size() - extension, extension, kExtension)) {
+            continue;
+         }
+         std::shared_ptr<const ConfigFile> file = read(m_directory + name);
+         if (file) {
+            m_files[name.substr(0, name.size() - extension)] = file;
+         }
+      }
+      closedir(dir);
+      return m_files.size();
+   }
+
+   // returns nullptr if there is no such config or it is empty
+   std::shared_ptr<const ConfigFile> find(const std::string &scene, const std::string &module) {
+      std::string key = scene + "_" + module;
+      std::string path = m_directory + key + kExtension;
+      std::lock_guard<std::mutex> guard(m_lock);
+      auto it = m_files.find(key);
+      if (it != m_files.end()) {
+         struct stat st;
+         if (stat(path.c_str(), &st) == 0 && it->second->matches(st)) {
+            return it->second;
+         }
+         m_files.erase(it);
+      }
+      std::shared_ptr<const ConfigFile> file = read(path);
+      if (file) {
+         m_files[key] = file;
+      }
+      return file;
+   }
+
+private:
+   static std::shared_ptr<const ConfigFile> read(const std::string &path) {
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd == -1) {
+         return nullptr;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0 || st.st_size == 0) {
+         close(fd);
+         return nullptr;
+      }
+
+      std::shared_ptr<ConfigFile> file = std::make_shared<ConfigFile>();
+      file->inode = st.st_ino;
+      file->size = st.st_size;
+      file->modified = st.st_mtim;
+      file->data.resize(st.st_size);
+      size_t got = 0;
+      while (got < file->data.size()) {
+         ssize_t n = ::read(fd, &file->data[got], file->data.size() - got);
+         if (n < 0 && errno == EINTR) {
+            continue;
+         }
+         if (n <= 0) {
+            // truncated while we read it; keep what is there
+            break;
+         }
+         got += n;
+      }
+      close(fd);
+      file->data.resize(got);
+      if (got == 0) {
+         return nullptr;
+      }
+
+      // one line per newline; a final newline does not start another line
+      std::string_view rest(file->data);
+      while (!rest.empty()) {
+         size_t end = rest.find('\n');
+         if (end == std::string_view::npos) {
+            file->lines.push_back(rest);
+            break;
+         }
+         file->lines.push_back(rest.substr(0, end));
+         rest.remove_prefix(end + 1);
+      }
+      return file;
+   }
+
+   std::string m_directory;
+   std::mutex m_lock;
+   std::unordered_map<std::string, std::shared_ptr<const ConfigFile>> m_files;
+};
+
+#endif //AMM_MODULES_CONFIG_CACHE_H
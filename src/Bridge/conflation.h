@@ -0,0 +1,226 @@
+#ifndef AMM_MODULES_CONFLATION_H
+#define AMM_MODULES_CONFLATION_H
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "realtime.h"
+#include "timer-wheel.h"
+#include "waveform.h"
+#include "wire-topic.h"
+
+class Session;
+
+// Last-value-wins state for one rate-limited subscription.
+struct ConflationSlot {
+   typedef std::chrono::steady_clock Clock;
+
+   ConflationSlot(Session *owner, const WireTopic &wireTopic, double maxRate, double deadbandValue) :
+      session(owner), wire(wireTopic), deadband(deadbandValue) {
+      if (maxRate > 0) {
+         period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / maxRate));
+      }
+   }
+
+   // port the value goes out on
+   Session *const session;
+   const WireTopic wire;
+   Clock::duration period = Clock::duration::zero();
+   const double deadband;
+
+   std::mutex lock;
+   bool hasSent = false;
+   double lastSent = 0;
+   Clock::time_point nextAllowed;
+   bool pending = false;
+   double pendingValue = 0;
+};
+
+// Conflates physiology values per topic.
+//
+// A value goes out immediately if its topic's max_rate allows it. Otherwise it
+// replaces whatever was waiting for that topic and is flushed by a background
+// thread, from a timer wheel, when the rate window opens, so the link only ever carries the newest
+// value and the backlog cannot grow. Values within the topic's deadband of the
+// last one sent are dropped.
+//
+// The same thread sends waveform blocks that have waited too long for their
+// last samples, from a second wheel.
+class Conflator {
+public:
+   typedef ConflationSlot::Clock Clock;
+   typedef std::function<void(Session *session, const WireTopic &topic, double value)> Emit;
+   typedef std::function<void(Session *session, const WireTopic &topic, const WaveformBlock &block)> EmitBlock;
+
+   explicit Conflator(Emit emit, EmitBlock emitBlock = nullptr) :
+      m_emit(std::move(emit)), m_emitBlock(std::move(emitBlock)) {}
+
+   ~Conflator() {
+      stop();
+   }
+
+   void start() {
+      m_running = true;
+      m_thread = std::thread(&Conflator::run, this);
+   }
+
+   void stop() {
+      {
+         std::lock_guard<std::mutex> guard(m_lock);
+         if (!m_running) {
+            return;
+         }
+         m_running = false;
+      }
+      m_wake.notify_one();
+      m_thread.join();
+   }
+
+   void offer(const std::shared_ptr<ConflationSlot> &slot, double value) {
+      Clock::time_point now = Clock::now();
+      std::unique_lock<std::mutex> slotGuard(slot->lock);
+
+      if (slot->hasSent && std::fabs(value - slot->lastSent) < slot->deadband) {
+         // the MCU already has a value close enough to this one
+         slot->pending = false;
+         return;
+      }
+
+      if (now >= slot->nextAllowed) {
+         send(*slot, value, now);
+         slotGuard.unlock();
+         m_emit(slot->session, slot->wire, value);
+         return;
+      }
+
+      slot->pendingValue = value;
+      if (!slot->pending) {
+         slot->pending = true;
+         Clock::time_point due = slot->nextAllowed;
+         slotGuard.unlock();
+         schedule(slot, due);
+      }
+   }
+
+   // Sends slot's waiting block at when if it is still short by then; called
+   // when offer() started a block.
+   void expire(const std::shared_ptr<WaveformSlot> &slot, Clock::time_point when) {
+      bool earlier;
+      {
+         std::lock_guard<std::mutex> guard(m_lock);
+         m_blocks.schedule(when, slot);
+         earlier = when < m_wakeAt;
+      }
+      if (earlier) {
+         m_wake.notify_one();
+      }
+   }
+
+private:
+   static void send(ConflationSlot &slot, double value, Clock::time_point now) {
+      slot.hasSent = true;
+      slot.lastSent = value;
+      slot.nextAllowed = now + slot.period;
+      slot.pending = false;
+   }
+
+   void schedule(const std::shared_ptr<ConflationSlot> &slot, Clock::time_point when) {
+      bool earlier;
+      {
+         std::lock_guard<std::mutex> guard(m_lock);
+         m_wheel.schedule(when, slot);
+         earlier = when < m_wakeAt;
+      }
+      if (earlier) {
+         m_wake.notify_one();
+      }
+   }
+
+   // earliest entry of either wheel
+   bool next(Clock::time_point &when) const {
+      Clock::time_point blocks;
+      bool any = m_wheel.next(when);
+      if (m_blocks.next(blocks) && (!any || blocks < when)) {
+         when = blocks;
+         any = true;
+      }
+      return any;
+   }
+
+   void run() {
+      Realtime::enter(Realtime::Role::WORKER);
+      std::vector<std::shared_ptr<ConflationSlot>> due;
+      std::vector<std::shared_ptr<WaveformSlot>> expired;
+      WaveformBlock block;
+      std::unique_lock<std::mutex> guard(m_lock);
+      while (m_running) {
+         Clock::time_point next;
+         if (!this->next(next)) {
+            m_wakeAt = Clock::time_point::max();
+            m_wake.wait(guard);
+            continue;
+         }
+         Clock::time_point now = Clock::now();
+         if (now < next) {
+            m_wakeAt = next;
+            m_wake.wait_until(guard, next);
+            continue;
+         }
+
+         m_wheel.advance(now, [&due](const std::shared_ptr<ConflationSlot> &slot, Clock::time_point) {
+            due.push_back(slot);
+         });
+         m_blocks.advance(now, [&expired](const std::shared_ptr<WaveformSlot> &slot, Clock::time_point) {
+            expired.push_back(slot);
+         });
+         guard.unlock();
+
+         for (const std::shared_ptr<ConflationSlot> &slot : due) {
+            bool flush = false;
+            double value = 0;
+            {
+               std::lock_guard<std::mutex> slotGuard(slot->lock);
+               if (slot->pending) {
+                  value = slot->pendingValue;
+                  send(*slot, value, Clock::now());
+                  flush = true;
+               }
+            }
+            if (flush) {
+               m_emit(slot->session, slot->wire, value);
+            }
+         }
+         due.clear();
+
+         for (const std::shared_ptr<WaveformSlot> &slot : expired) {
+            if (slot->expire(now, block) && m_emitBlock) {
+               m_emitBlock(slot->session, slot->wire, block);
+            }
+         }
+         expired.clear();
+
+         guard.lock();
+      }
+   }
+
+   Emit m_emit;
+   EmitBlock m_emitBlock;
+   std::mutex m_lock;
+   std::condition_variable m_wake;
+   TimerWheel<std::shared_ptr<ConflationSlot>> m_wheel;
+   // waveform slots by when their current block expires
+   TimerWheel<std::shared_ptr<WaveformSlot>> m_blocks;
+   // when the flush thread is due to wake up by itself
+   Clock::time_point m_wakeAt = Clock::time_point::max();
+   std::thread m_thread;
+   bool m_running = false;
+};
+
+#endif //AMM_MODULES_CONFLATION_H
@@ -0,0 +1,169 @@
+#ifndef AMM_MODULES_FRAME_POOL_H
+#define AMM_MODULES_FRAME_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mpsc-queue.h"
+
+// Outbound traffic classes, in the order the serial writer serves them.
+//
+// CONTROL (simulation control, commands, keepalives, protocol switches) is
+// strict priority and never dropped. MODIFICATION (render and physiology
+// modifications, configuration) is a bounded FIFO that refuses new frames
+// when full. TELEMETRY (values and waveforms) is bounded too but drops its
+// oldest frame instead, since a newer sample supersedes it.
+enum class Lane : uint8_t {
+   CONTROL,
+   MODIFICATION,
+   TELEMETRY,
+   COUNT
+};
+
+inline const char *laneName(Lane lane) {
+   static const char *names[] = {"control", "modification", "telemetry"};
+   return names[static_cast<size_t>(lane)];
+}
+
+// One outbound message on its way to the serial port.
+struct Frame {
+   static const uint16_t kNoTopic = 0xffff;
+   // marks a keepalive ping, so the writer can note when it left
+   static const uint16_t kPingTopic = 0xfffe;
+   // not sent: switches the port to the baud rate in data once every frame
+   // queued before it on its lane has left the wire
+   static const uint16_t kBaudTopic = 0xfffd;
+   // the text line confirming the switch to the binary wire protocol; every
+   // frame the writer sends after it is binary
+   static const uint16_t kProtocolTopic = 0xfffc;
+   // not sent: switches the writer back to text after the MCU has; binary
+   // frames still queued when it takes effect are dropped
+   static const uint16_t kTextTopic = 0xfffb;
+
+   std::string data;
+   // when the message was produced, for the DDS to serial latency
+   std::chrono::steady_clock::time_point created;
+   // binary topic id of a value, kNoTopic for everything else
+   uint16_t topic = kNoTopic;
+   Lane lane = Lane::MODIFICATION;
+   // formatted for the binary wire protocol rather than as a text line
+   bool binary = false;
+};
+
+// Fixed set of preallocated frames shared by the producers and the serial
+// writer. Every frame reserves kDefaultFrameCapacity bytes up front; a frame
+// that ever needs more keeps the larger buffer, so at steady state formatting
+// into a pooled frame allocates nothing. reserve() raises the capacity for
+// messages known to be larger, and each frame grows to it once, the next
+// time it is acquired. acquire() and release() are lock-free.
+class FramePool {
+public:
+   static const size_t kDefaultFrameCapacity = 256;
+
+   FramePool(size_t count, size_t frameCapacity = kDefaultFrameCapacity) :
+      m_frames(new Frame[count]), m_count(count), m_free(count), m_capacity(frameCapacity) {
+      for (size_t i = 0; i < count; ++i) {
+         m_frames[i].data.reserve(frameCapacity);
+         Frame *frame = &m_frames[i];
+         m_free.tryPush(std::move(frame));
+      }
+   }
+
+   // returns nullptr when every frame is in flight
+   Frame *acquire() {
+      Frame *frame = nullptr;
+      if (m_free.tryPop(frame)) {
+         frame->data.clear();
+         // string::reserve() below the current capacity may shrink it
+         size_t capacity = m_capacity.load(std::memory_order_relaxed);
+         if (frame->data.capacity() < capacity) {
+            frame->data.reserve(capacity);
+         }
+         frame->created = std::chrono::steady_clock::now();
+         frame->topic = Frame::kNoTopic;
+         frame->binary = false;
+      }
+      return frame;
+   }
+
+   void release(Frame *frame) {
+      m_free.tryPush(std::move(frame));
+   }
+
+   // false for a frame allocated outside the pool
+   bool owns(const Frame *frame) const {
+      return frame >= m_frames.get() && frame < m_frames.get() + m_count;
+   }
+
+   size_t size() const {
+      return m_count;
+   }
+
+   // frames are handed out with at least capacity bytes from now on; never
+   // lowers it
+   void reserve(size_t capacity) {
+      size_t current = m_capacity.load(std::memory_order_relaxed);
+      while (capacity > current && !m_capacity.compare_exchange_weak(current, capacity, std::memory_order_relaxed)) {
+      }
+   }
+
+private:
+   std::unique_ptr<Frame[]> m_frames;
+   size_t m_count;
+   MpscQueue<Frame *> m_free;
+   std::atomic<size_t> m_capacity;
+};
+
+// FIFO of frames for a lane that must never refuse one. It keeps the storage
+// it has grown to, so once it has held its largest burst, queuing allocates
+// nothing; a std::deque frees and reallocates a node every few dozen frames.
+class FrameRing {
+public:
+   explicit FrameRing(size_t capacity) : m_slots(capacity ? capacity : 1) {}
+
+   bool empty() const {
+      return m_count == 0;
+   }
+
+   size_t size() const {
+      return m_count;
+   }
+
+   Frame *front() const {
+      return m_slots[m_head];
+   }
+
+   void push_back(Frame *frame) {
+      if (m_count == m_slots.size()) {
+         grow();
+      }
+      m_slots[(m_head + m_count) % m_slots.size()] = frame;
+      ++m_count;
+   }
+
+   void pop_front() {
+      m_head = (m_head + 1) % m_slots.size();
+      --m_count;
+   }
+
+private:
+   void grow() {
+      std::vector<Frame *> slots(m_slots.size() * 2);
+      for (size_t i = 0; i < m_count; ++i) {
+         slots[i] = m_slots[(m_head + i) % m_slots.size()];
+      }
+      m_slots.swap(slots);
+      m_head = 0;
+   }
+
+   std::vector<Frame *> m_slots;
+   size_t m_head = 0;
+   size_t m_count = 0;
+};
+
+#endif //AMM_MODULES_FRAME_POOL_H
@@ -0,0 +1,166 @@
+#ifndef AMM_MODULES_LINK_MONITOR_H
+#define AMM_MODULES_LINK_MONITOR_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#include "metrics.h"
+
+// Keepalive pings and link health for one MCU.
+//
+// Once the MCU asks for keepalives, the bridge sends
+// [KEEPALIVE]seq=<n>;t=<us> every interval and the MCU echoes the line back.
+// The round trip is timed from when the ping actually left the serial writer,
+// so time spent behind other frames in our own queue does not count against
+// the MCU. The link is considered down after kMissedLimit intervals without an
+// echo and up again at the next one.
+//
+// The measured RTT also drives the transmit pacing: when it climbs well above
+// the best seen, the MCU is falling behind on what we send, so the rate is cut
+// multiplicatively; while it stays close, the rate recovers additively.
+//
+// Only the reactor shard that owns the port calls into a monitor.
+class LinkMonitor {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   static const int kMissedLimit = 3;
+   static constexpr double kDecrease = 0.8;
+   static constexpr double kIncrease = 0.05;
+   static constexpr double kMinScale = 0.25;
+   // RTT above the best seen by more than this, or the best RTT itself if
+   // larger, counts as the MCU falling behind
+   static constexpr std::chrono::milliseconds kSlack{5};
+
+   void enable(std::chrono::milliseconds interval) {
+      m_interval = interval;
+      scale.set(static_cast<uint64_t>(m_scale * 1000));
+   }
+
+   bool enabled() const {
+      return m_interval.count() > 0;
+   }
+
+   bool up() const {
+      return m_up;
+   }
+
+   // Formats the next ping into line if one is due at now.
+   bool ping(Clock::time_point now, std::string &line) {
+      if (!enabled() || now < m_nextPing) {
+         return false;
+      }
+      if (m_awaiting) {
+         missed.add();
+      }
+      m_nextPing = now + m_interval;
+      m_awaiting = true;
+      ++m_seq;
+      if (m_lastEcho == Clock::time_point()) {
+         m_lastEcho = now;
+      }
+      line = "[KEEPALIVE]seq=" + std::to_string(m_seq) + ";t=" + std::to_string(micros(now.time_since_epoch())) + "\n";
+      sent.add();
+      return true;
+   }
+
+   // Handles an echo whose ping left the writer at written. returns true if
+   // the link just came back up.
+   bool echo(uint32_t seq, Clock::time_point written, Clock::time_point now) {
+      echoed.add();
+      m_lastEcho = now;
+      if (seq == m_seq) {
+         m_awaiting = false;
+         if (written != Clock::time_point() && now > written) {
+            measured(now - written);
+         }
+      }
+      bool cameUp = !m_up;
+      m_up = true;
+      return cameUp;
+   }
+
+   // returns true if the link just went down
+   bool check(Clock::time_point now) {
+      if (!enabled() || !m_up || m_lastEcho == Clock::time_point()) {
+         return false;
+      }
+      if (now - m_lastEcho > kMissedLimit * m_interval) {
+         m_up = false;
+         return true;
+      }
+      return false;
+   }
+
+   // when ping() or check() next has something to do
+   Clock::time_point nextDue() const {
+      if (!enabled()) {
+         return Clock::time_point::max();
+      }
+      Clock::time_point due = m_nextPing;
+      if (m_up && m_lastEcho != Clock::time_point()) {
+         due = std::min(due, m_lastEcho + kMissedLimit * m_interval + Clock::duration(1));
+      }
+      return due;
+   }
+
+   // fraction of the configured transmit rate to pace at
+   double rateScale() const {
+      return m_scale;
+   }
+
+   std::chrono::milliseconds silence(Clock::time_point now) const {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(now - m_lastEcho);
+   }
+
+   Counter sent;
+   Counter echoed;
+   Counter missed;
+   LatencyHistogram rtt;
+   // RFC 3550 style smoothed RTT variation in nanoseconds
+   Gauge jitter;
+   // rateScale() in thousandths, for the metrics
+   Gauge scale;
+
+private:
+   static uint64_t micros(Clock::duration d) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+   }
+
+   void measured(Clock::duration d) {
+      uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+      rtt.record(ns);
+
+      if (m_lastRtt) {
+         double delta = std::abs(static_cast<double>(ns) - static_cast<double>(m_lastRtt));
+         m_jitter += (delta - m_jitter) / 16;
+         jitter.set(static_cast<uint64_t>(m_jitter));
+      }
+      m_lastRtt = ns;
+
+      m_bestRtt = m_bestRtt ? std::min(m_bestRtt, ns) : ns;
+      uint64_t slack = std::max<uint64_t>(m_bestRtt, std::chrono::nanoseconds(kSlack).count());
+      if (ns > m_bestRtt + slack) {
+         m_scale = std::max(kMinScale, m_scale * kDecrease);
+      } else {
+         m_scale = std::min(1.0, m_scale + kIncrease);
+      }
+      scale.set(static_cast<uint64_t>(m_scale * 1000));
+   }
+
+   std::chrono::milliseconds m_interval{0};
+   Clock::time_point m_nextPing;
+   Clock::time_point m_lastEcho;
+   uint32_t m_seq = 0;
+   bool m_awaiting = false;
+   bool m_up = true;
+   uint64_t m_lastRtt = 0;
+   uint64_t m_bestRtt = 0;
+   double m_jitter = 0;
+   double m_scale = 1.0;
+};
+
+#endif //AMM_MODULES_LINK_MONITOR_H
@@ -0,0 +1,82 @@
+#ifndef AMM_MODULES_MESSAGE_FORMAT_H
+#define AMM_MODULES_MESSAGE_FORMAT_H
+
+#include <charconv>
+#include <string>
+
+#include "frame-pool.h"
+#include "waveform.h"
+
+// Formatters for the outbound text protocol. They append to a pooled Frame
+// and never build temporaries, so an outbound sample costs no allocations.
+
+namespace MessageFormat {
+
+   static constexpr const char *kCommandPrefix = "[AMM_Command]";
+   static constexpr const char *kPhysiologyModificationPrefix = "[AMM_Physiology_Modification]";
+   static constexpr const char *kRenderModificationPrefix = "[AMM_Render_Modification]";
+
+   // same output as an ostream with its default precision
+   static const int kValuePrecision = 6;
+
+   inline void appendValue(std::string &out, double value) {
+      char digits[32];
+      std::to_chars_result r = std::to_chars(digits, digits + sizeof(digits), value,
+                                             std::chars_format::general, kValuePrecision);
+      out.append(digits, r.ptr - digits);
+   }
+
+   // <prefix><value>\n, where prefix is "[map_name]" or "[AMM_Node_Data]name="
+   inline void value(Frame &frame, const std::string &prefix, double value) {
+      frame.data.append(prefix);
+      appendValue(frame.data, value);
+      frame.data.push_back('\n');
+   }
+
+   // sign, digits, point and a two digit exponent of a float, and the comma
+   static_assert(kValuePrecision + 7 <= WaveformSlot::kMaxSampleText, "waveform frames are sized for the widest sample");
+
+   // <prefix>t=<start us>;dt=<interval us>;v=<v1>,<v2>,...\n, where prefix is
+   // "[map_name]" or "[HF_name]"
+   inline void waveform(Frame &frame, const std::string &prefix, const WaveformBlock &block) {
+      char digits[16];
+      frame.data.append(prefix);
+      frame.data.append("t=");
+      frame.data.append(digits, std::to_chars(digits, digits + sizeof(digits), block.start).ptr - digits);
+      frame.data.append(";dt=");
+      frame.data.append(digits, std::to_chars(digits, digits + sizeof(digits), block.interval).ptr - digits);
+      frame.data.append(";v=");
+      for (size_t i = 0; i < block.samples.size(); ++i) {
+         if (i) {
+            frame.data.push_back(',');
+         }
+         appendValue(frame.data, block.samples[i]);
+      }
+      frame.data.push_back('\n');
+   }
+
+   // <prefix>type=<type>;payload=<payload>\n
+   inline void modification(Frame &frame, const char *prefix, const std::string &type,
+                            const std::string &payload) {
+      frame.data.append(prefix);
+      frame.data.append("type=");
+      frame.data.append(type);
+      frame.data.append(";payload=");
+      frame.data.append(payload);
+      frame.data.push_back('\n');
+   }
+
+   // [AMM_Command]<command>\n
+   inline void command(Frame &frame, const char *command, size_t len) {
+      frame.data.append(kCommandPrefix);
+      frame.data.append(command, len);
+      frame.data.push_back('\n');
+   }
+
+   inline void command(Frame &frame, const std::string &command) {
+      MessageFormat::command(frame, command.data(), command.size());
+   }
+
+}
+
+#endif //AMM_MODULES_MESSAGE_FORMAT_H
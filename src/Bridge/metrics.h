@@ -0,0 +1,199 @@
+#ifndef AMM_MODULES_METRICS_H
+#define AMM_MODULES_METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
+// Low-overhead counters for the hot paths.
+//
+// Every Counter and LatencyHistogram has exactly one thread that records into
+// it: the writer thread of a port records what it sends and the reactor shard
+// that owns a port records what it reads. Recording is therefore a relaxed
+// load and store on a line nobody else writes, with no locked instruction and
+// no contention; readers such as the STATS command only ever load.
+
+// Monotonic count written by a single thread and readable from any.
+class Counter {
+public:
+   void add(uint64_t n = 1) {
+      m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+   }
+
+   // keeps the largest value ever seen
+   void raise(uint64_t n) {
+      if (n > m_value.load(std::memory_order_relaxed)) {
+         m_value.store(n, std::memory_order_relaxed);
+      }
+   }
+
+   uint64_t value() const {
+      return m_value.load(std::memory_order_relaxed);
+   }
+
+private:
+   std::atomic<uint64_t> m_value{0};
+};
+
+// Current value of something, written by a single thread and readable from any.
+class Gauge {
+public:
+   void set(uint64_t n) {
+      m_value.store(n, std::memory_order_relaxed);
+   }
+
+   uint64_t value() const {
+      return m_value.load(std::memory_order_relaxed);
+   }
+
+private:
+   std::atomic<uint64_t> m_value{0};
+};
+
+// HDR-style log-linear latency histogram in nanoseconds.
+//
+// Each power of two is split into 32 linear sub-buckets, so a recorded value
+// is reported to within about 3% across nine orders of magnitude, from
+// nanoseconds to minutes, in a fixed 10 KB table.
+class LatencyHistogram {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   static const int kSubBucketBits = 5;
+   static const uint64_t kSubBuckets = 1 << kSubBucketBits;
+   static const int kMaxBits = 40;
+   static const size_t kBuckets = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+   LatencyHistogram() : m_buckets(new Counter[kBuckets]) {}
+
+   void record(uint64_t ns) {
+      ns = std::min<uint64_t>(ns, (uint64_t(1) << kMaxBits) - 1);
+      m_buckets[index(ns)].add();
+      m_count.add();
+      m_max.raise(ns);
+   }
+
+   void record(Clock::time_point start, Clock::time_point end) {
+      record(end > start ? std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() : 0);
+   }
+
+   uint64_t count() const {
+      return m_count.value();
+   }
+
+   uint64_t max() const {
+      return m_max.value();
+   }
+
+   // value at quantile q (0..1) in nanoseconds, the midpoint of its bucket
+   uint64_t percentile(double q) const {
+      uint64_t total = count();
+      if (total == 0) {
+         return 0;
+      }
+      uint64_t rank = static_cast<uint64_t>(q * total);
+      if (rank >= total) {
+         rank = total - 1;
+      }
+      uint64_t seen = 0;
+      for (size_t i = 0; i < kBuckets; ++i) {
+         seen += m_buckets[i].value();
+         if (seen > rank) {
+            return std::min(midpoint(i), max());
+         }
+      }
+      return max();
+   }
+
+   // one line: count, p50/p99/p999 and max in microseconds
+   void report(std::ostream &os) const {
+      os << "count=" << count()
+         << " p50=" << percentile(0.5) / 1000.0
+         << " p99=" << percentile(0.99) / 1000.0
+         << " p999=" << percentile(0.999) / 1000.0
+         << " max=" << max() / 1000.0;
+   }
+
+private:
+   static size_t index(uint64_t ns) {
+      int msb = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+      int shift = std::max(0, msb - kSubBucketBits);
+      return shift * kSubBuckets + (ns >> shift);
+   }
+
+   static uint64_t midpoint(size_t i) {
+      if (i < 2 * kSubBuckets) {
+         return i;
+      }
+      int shift = static_cast<int>(i / kSubBuckets) - 1;
+      uint64_t low = (i % kSubBuckets + kSubBuckets) << shift;
+      return low + (uint64_t(1) << shift) / 2;
+   }
+
+   std::unique_ptr<Counter[]> m_buckets;
+   Counter m_count;
+   Counter m_max;
+};
+
+// What arrived on a serial port, by line prefix.
+enum class LineType : uint8_t {
+   REPORT,
+   COMMAND,
+   XML,
+   TOPIC,
+   BINARY,
+   CONTROL,
+   DEBUG,
+   COUNT
+};
+
+inline const char *lineTypeName(LineType type) {
+   static const char *names[] = {"report", "command", "xml", "topic", "binary", "control", "debug"};
+   return names[static_cast<size_t>(type)];
+}
+
+// Read side of a port, recorded by the reactor shard that owns it.
+struct ReaderStats {
+   Counter bytes;
+   Counter lines;
+   Counter received[static_cast<size_t>(LineType::COUNT)];
+   Counter parseErrors[static_cast<size_t>(LineType::COUNT)];
+   Counter publishDropped;
+   // time the reactor spent on one wakeup of the port, and how often that
+   // exceeded the deadline
+   LatencyHistogram handle;
+   Counter missedDeadlines;
+   // from reading the line off the port to its DDS write returning; recorded
+   // by the publish worker, the only thread that writes to DDS
+   LatencyHistogram serialToDds;
+};
+
+// Write side of a port, recorded by its writer thread.
+struct WriterStats {
+   // per-topic counts are kept for the first kMaxTopics binary topic ids
+   static const size_t kMaxTopics = 256;
+
+   Counter frames;
+   Counter bytes;
+   // writev() calls; frames / writes is the average batch
+   Counter writes;
+   Counter eagain;
+   Counter shortWrites;
+   // waits for the tty to drain, and how long they took
+   Counter stalls;
+   LatencyHistogram stalled;
+   Counter highWater;
+   Counter topics[kMaxTopics];
+   // the writer woke up more than the deadline after a frame was due
+   Counter missedDeadlines;
+   // from the DDS callback, or the conflator flush, to the write() returning
+   LatencyHistogram ddsToSerial;
+   // the same, for each outbound lane
+   static const size_t kLanes = 3;
+   LatencyHistogram laneLatency[kLanes];
+};
+
+#endif //AMM_MODULES_METRICS_H
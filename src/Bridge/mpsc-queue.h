@@ -0,0 +1,109 @@
+#ifndef AMM_MODULES_MPSC_QUEUE_H
+#define AMM_MODULES_MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Bounded lock-free multi-producer queue (Vyukov's sequence-per-slot ring).
+//
+// Producers claim a slot with a CAS on the enqueue position and publish it by
+// bumping the slot's sequence number, so a DDS listener thread never blocks on
+// another or on the consumer. tryPush() fails instead of waiting when the ring
+// is full. The serial writer is the single consumer, but tryPop() is safe to
+// call from several threads as well.
+template<typename T>
+class MpscQueue {
+public:
+   // capacity is rounded up to a power of two
+   explicit MpscQueue(size_t capacity) {
+      size_t size = 2;
+      while (size < capacity) {
+         size <<= 1;
+      }
+      m_mask = size - 1;
+      m_cells.reset(new Cell[size]);
+      for (size_t i = 0; i < size; ++i) {
+         m_cells[i].sequence.store(i, std::memory_order_relaxed);
+      }
+   }
+
+   MpscQueue(const MpscQueue &) = delete;
+   MpscQueue &operator=(const MpscQueue &) = delete;
+
+   bool tryPush(T &&value) {
+      size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+      Cell *cell;
+      for (;;) {
+         cell = &m_cells[pos & m_mask];
+         size_t seq = cell->sequence.load(std::memory_order_acquire);
+         intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+         if (diff == 0) {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+               break;
+            }
+         } else if (diff < 0) {
+            return false;
+         } else {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+         }
+      }
+      cell->value = std::move(value);
+      cell->sequence.store(pos + 1, std::memory_order_release);
+      return true;
+   }
+
+   bool tryPop(T &value) {
+      size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+      Cell *cell;
+      for (;;) {
+         cell = &m_cells[pos & m_mask];
+         size_t seq = cell->sequence.load(std::memory_order_acquire);
+         intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+         if (diff == 0) {
+            if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+               break;
+            }
+         } else if (diff < 0) {
+            return false;
+         } else {
+            pos = m_dequeuePos.load(std::memory_order_relaxed);
+         }
+      }
+      value = std::move(cell->value);
+      cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+      return true;
+   }
+
+   // approximate, for metrics and idle checks only
+   size_t size() const {
+      size_t enq = m_enqueuePos.load(std::memory_order_relaxed);
+      size_t deq = m_dequeuePos.load(std::memory_order_relaxed);
+      return enq > deq ? enq - deq : 0;
+   }
+
+   bool empty() const {
+      return size() == 0;
+   }
+
+   size_t capacity() const {
+      return m_mask + 1;
+   }
+
+private:
+   struct Cell {
+      std::atomic<size_t> sequence;
+      T value;
+   };
+
+   static const size_t kCacheLine = 64;
+
+   std::unique_ptr<Cell[]> m_cells;
+   size_t m_mask;
+   alignas(kCacheLine) std::atomic<size_t> m_enqueuePos{0};
+   alignas(kCacheLine) std::atomic<size_t> m_dequeuePos{0};
+};
+
+#endif //AMM_MODULES_MPSC_QUEUE_H
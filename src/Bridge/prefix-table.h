@@ -0,0 +1,84 @@
+#ifndef AMM_MODULES_PREFIX_TABLE_H
+#define AMM_MODULES_PREFIX_TABLE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "metrics.h"
+
+// One kind of inbound line: the prefix that identifies it and its handler.
+template<typename Handler>
+struct LinePrefix {
+   std::string_view prefix;
+   LineType type = LineType::DEBUG;
+   Handler handler{};
+};
+
+// Dispatch table for the inbound protocol, built at compile time.
+//
+// The prefixes are bucketed by their first byte and, within a bucket, ordered
+// longest first, so classifying a line is a jump on its first byte followed by
+// a length check and compare against the few prefixes that start with it. A
+// prefix that is itself the start of a longer one ("[" and "[REPORT]") only
+// matches when the longer ones do not. Adding a message kind is one more
+// table entry.
+template<typename Handler, size_t N>
+class PrefixTable {
+public:
+   constexpr explicit PrefixTable(const LinePrefix<Handler> (&prefixes)[N]) : m_prefixes(), m_buckets() {
+      for (size_t i = 0; i < N; ++i) {
+         m_prefixes[i] = prefixes[i];
+      }
+      // insertion sort on (first byte, longest first)
+      for (size_t i = 1; i < N; ++i) {
+         LinePrefix<Handler> entry = m_prefixes[i];
+         size_t j = i;
+         while (j > 0 && before(entry, m_prefixes[j - 1])) {
+            m_prefixes[j] = m_prefixes[j - 1];
+            --j;
+         }
+         m_prefixes[j] = entry;
+      }
+      for (size_t i = 0; i < N; ++i) {
+         Bucket &bucket = m_buckets[static_cast<uint8_t>(m_prefixes[i].prefix[0])];
+         if (bucket.end == 0) {
+            bucket.begin = i;
+         }
+         bucket.end = i + 1;
+      }
+   }
+
+   // returns nullptr if no prefix matches
+   constexpr const LinePrefix<Handler> *find(std::string_view line) const {
+      if (line.empty()) {
+         return nullptr;
+      }
+      const Bucket &bucket = m_buckets[static_cast<uint8_t>(line[0])];
+      for (size_t i = bucket.begin; i < bucket.end; ++i) {
+         const LinePrefix<Handler> &entry = m_prefixes[i];
+         if (line.size() >= entry.prefix.size() && line.compare(0, entry.prefix.size(), entry.prefix) == 0) {
+            return &entry;
+         }
+      }
+      return nullptr;
+   }
+
+private:
+   struct Bucket {
+      size_t begin = 0;
+      size_t end = 0;
+   };
+
+   static constexpr bool before(const LinePrefix<Handler> &a, const LinePrefix<Handler> &b) {
+      uint8_t first = static_cast<uint8_t>(a.prefix[0]);
+      uint8_t other = static_cast<uint8_t>(b.prefix[0]);
+      return first != other ? first < other : a.prefix.size() > b.prefix.size();
+   }
+
+   std::array<LinePrefix<Handler>, N> m_prefixes;
+   std::array<Bucket, 256> m_buckets;
+};
+
+#endif //AMM_MODULES_PREFIX_TABLE_H
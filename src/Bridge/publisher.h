@@ -0,0 +1,168 @@
+#ifndef AMM_MODULES_PUBLISHER_H
+#define AMM_MODULES_PUBLISHER_H
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <variant>
+
+#include "amm_std.h"
+
+#include "metrics.h"
+#include "mpsc-queue.h"
+#include "realtime.h"
+#include "session.h"
+
+// One parsed inbound message waiting to go out on DDS.
+struct PublishJob {
+   typedef std::variant<AMM::Command,
+                        AMM::RenderModification,
+                        AMM::PhysiologyModification,
+                        AMM::Assessment,
+                        AMM::Status,
+                        AMM::InstrumentData,
+                        AMM::OperationalDescription> Sample;
+
+   // port the message came in on
+   Session *session = nullptr;
+   // when its line was read, for the serial to DDS latency
+   LatencyHistogram::Clock::time_point received;
+   Sample sample;
+};
+
+// DDS publish stage for everything the MCUs send.
+//
+// The reactor shards only parse lines and hand the resulting samples over a
+// bounded lock-free queue, so DDS back-pressure can never stop us reading a
+// UART. A single worker thread drains the queue in batches of up to kBatch
+// samples per wake-up and does the mgr->Write* calls, keeping the publish
+// order of each port. Like the serial writer it sleeps on an eventfd and
+// producers only pay for the wake-up when it is asleep.
+class Publisher {
+public:
+   typedef std::function<void(PublishJob::Sample &sample)> Write;
+
+   static const size_t kDefaultCapacity = 4096;
+   static const size_t kBatch = 64;
+   static const int kIdleTimeoutMs = 500;
+
+   explicit Publisher(Write write, size_t capacity = kDefaultCapacity) :
+      m_write(std::move(write)), m_queue(capacity), m_wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+   ~Publisher() {
+      stop();
+      if (m_wakeFd >= 0) {
+         close(m_wakeFd);
+      }
+   }
+
+   void start() {
+      m_running = true;
+      m_thread = std::thread(&Publisher::run, this);
+   }
+
+   // publishes whatever is still queued, then joins the worker
+   void stop() {
+      if (m_running.exchange(false)) {
+         wake();
+         m_thread.join();
+      }
+   }
+
+   // returns false if the queue is full and the sample was dropped
+   bool publish(PublishJob &&job) {
+      if (!m_queue.tryPush(std::move(job))) {
+         return false;
+      }
+      if (m_sleeping.exchange(false)) {
+         wake();
+      }
+      return true;
+   }
+
+   size_t depth() const {
+      return m_queue.size();
+   }
+
+   // recorded by the worker thread
+   uint64_t highWater() const {
+      return m_highWater.value();
+   }
+
+   uint64_t batches() const {
+      return m_batches.value();
+   }
+
+private:
+   void wake() {
+      uint64_t one = 1;
+      ssize_t n = write(m_wakeFd, &one, sizeof(one));
+      (void) n;
+   }
+
+   // returns how many jobs were published
+   size_t drain() {
+      size_t n = 0;
+      PublishJob job;
+      while (n < kBatch && m_queue.tryPop(job)) {
+         if (n == 0) {
+            m_highWater.raise(m_queue.size() + 1);
+         }
+         m_write(job.sample);
+         if (job.session) {
+            job.session->published(job.received);
+         }
+         ++n;
+      }
+      if (n) {
+         m_batches.add();
+      }
+      return n;
+   }
+
+   void run() {
+      Realtime::enter(Realtime::Role::WORKER);
+      while (m_running) {
+         if (drain()) {
+            continue;
+         }
+
+         // same sleep handshake as the serial writer
+         m_sleeping = true;
+         if (!m_queue.empty()) {
+            m_sleeping = false;
+            continue;
+         }
+
+         struct pollfd pfd;
+         pfd.fd = m_wakeFd;
+         pfd.events = POLLIN;
+         pfd.revents = 0;
+         if (poll(&pfd, 1, kIdleTimeoutMs) > 0) {
+            uint64_t count;
+            ssize_t n = read(m_wakeFd, &count, sizeof(count));
+            (void) n;
+         }
+         m_sleeping = false;
+      }
+
+      while (drain()) {
+      }
+   }
+
+   Write m_write;
+   MpscQueue<PublishJob> m_queue;
+   int m_wakeFd;
+   std::thread m_thread;
+   std::atomic<bool> m_running{false};
+   std::atomic<bool> m_sleeping{false};
+   Counter m_highWater;
+   Counter m_batches;
+};
+
+#endif //AMM_MODULES_PUBLISHER_H
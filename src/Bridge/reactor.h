@@ -0,0 +1,305 @@
+#ifndef AMM_MODULES_REACTOR_H
+#define AMM_MODULES_REACTOR_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "realtime.h"
+#include "session.h"
+#include "timer-wheel.h"
+
+// epoll reactor that drives the read side of every session, and all of the
+// bridge's timed work.
+//
+// Sessions are spread round-robin over a fixed number of shards. Each shard
+// has its own epoll set and thread, so a session is only ever read from one
+// thread and its line handler never runs concurrently with itself. Besides
+// the serial fds, a shard waits on a timerfd armed for the earliest entry of
+// its timer wheel and on an eventfd that stop() uses to end the loop at once,
+// so the loop sleeps until there is something to do and never polls. Other
+// fds, such as stdin and a signalfd, can be watched on the first shard.
+//
+// Every session is ticked when it asks to be: the tick handlers return when
+// they next need to run, and a session is also ticked right after each read
+// since a line may have changed what it waits for. Work started on another
+// thread asks for a tick with Session::requestTick().
+class Reactor {
+public:
+   typedef std::chrono::steady_clock Clock;
+   typedef std::function<void(Session &, std::string_view)> LineHandler;
+   // Periodic work for a session, run on the shard that reads it. Returns
+   // when the session next needs a tick, Clock::time_point::max() if only
+   // when a line arrives.
+   typedef std::function<Clock::time_point(Session &, Clock::time_point)> TickHandler;
+   typedef std::function<void()> ReadyHandler;
+
+   static const int kMaxEvents = 16;
+
+   Reactor(size_t shards, LineHandler handler, TickHandler tick = nullptr) :
+      m_handler(std::move(handler)), m_tick(std::move(tick)) {
+      if (shards == 0) {
+         shards = 1;
+      }
+      for (size_t i = 0; i < shards; ++i) {
+         std::unique_ptr<Shard> shard(new Shard);
+         shard->epfd = epoll_create1(EPOLL_CLOEXEC);
+         shard->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+         shard->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+         watch(*shard, shard->timerFd, Watch::TIMER, nullptr);
+         watch(*shard, shard->wakeFd, Watch::WAKE, nullptr);
+         m_shards.push_back(std::move(shard));
+      }
+   }
+
+   ~Reactor() {
+      for (auto &shard : m_shards) {
+         if (shard->thread.joinable()) {
+            shard->thread.join();
+         }
+         ::close(shard->epfd);
+         ::close(shard->timerFd);
+         ::close(shard->wakeFd);
+      }
+   }
+
+   // Returns false if the session's fd could not be watched. A session that
+   // is not read is only ticked; a replay feeds it lines instead.
+   bool add(Session &session, bool read = true) {
+      Shard &shard = *m_shards[m_next++ % m_shards.size()];
+      if (read && !watch(shard, session.fd(), Watch::SESSION, &session)) {
+         return false;
+      }
+      shard.sessions.push_back(&session);
+      Clock::time_point now = Clock::now();
+      shard.due[&session] = now;
+      shard.wheel.schedule(now, Timer{&session, now});
+      session.onTickRequest([&shard] {
+         shard.sweep = true;
+         uint64_t one = 1;
+         ssize_t n = write(shard.wakeFd, &one, sizeof(one));
+         (void) n;
+      });
+      return true;
+   }
+
+   // Calls ready() on the first shard whenever fd is readable; ready() must
+   // consume what is there. returns false if fd could not be watched.
+   bool watch(int fd, ReadyHandler ready) {
+      std::unique_ptr<Watch> w(new Watch{Watch::FD, fd, nullptr, std::move(ready)});
+      Shard &shard = *m_shards[0];
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.ptr = w.get();
+      if (epoll_ctl(shard.epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+         return false;
+      }
+      shard.watches.push_back(std::move(w));
+      return true;
+   }
+
+   // stops watching an fd added with watch(fd, ready), e.g. at end of file
+   void unwatch(int fd) {
+      epoll_ctl(m_shards[0]->epfd, EPOLL_CTL_DEL, fd, nullptr);
+   }
+
+   // Runs the first shard on the calling thread and the others on their own
+   // until stop().
+   void run() {
+      for (size_t i = 1; i < m_shards.size(); ++i) {
+         Shard *shard = m_shards[i].get();
+         shard->thread = std::thread([this, shard] {
+            loop(*shard);
+         });
+      }
+      loop(*m_shards[0]);
+      for (size_t i = 1; i < m_shards.size(); ++i) {
+         m_shards[i]->thread.join();
+      }
+   }
+
+   // Ends every shard's loop promptly; safe from any thread, including a
+   // handler.
+   void stop() {
+      m_stopped = true;
+      for (auto &shard : m_shards) {
+         uint64_t one = 1;
+         ssize_t n = write(shard->wakeFd, &one, sizeof(one));
+         (void) n;
+      }
+   }
+
+   size_t shards() const {
+      return m_shards.size();
+   }
+
+private:
+   struct Watch {
+      enum Kind {
+         SESSION,
+         TIMER,
+         WAKE,
+         FD
+      };
+
+      Kind kind;
+      int fd;
+      Session *session;
+      ReadyHandler ready;
+   };
+
+   // a session's tick as scheduled on the wheel
+   struct Timer {
+      Session *session;
+      Clock::time_point due;
+   };
+
+   struct Shard {
+      int epfd = -1;
+      int timerFd = -1;
+      int wakeFd = -1;
+      std::thread thread;
+      std::vector<Session *> sessions;
+      std::vector<std::unique_ptr<Watch>> watches;
+      TimerWheel<Timer> wheel;
+      // when each session's current tick is due; wheel entries that do not
+      // match are stale and skipped
+      std::unordered_map<Session *, Clock::time_point> due;
+      Clock::time_point armed = Clock::time_point::max();
+      // some session asked for a tick from another thread
+      std::atomic<bool> sweep{false};
+   };
+
+   bool watch(Shard &shard, int fd, Watch::Kind kind, Session *session) {
+      std::unique_ptr<Watch> w(new Watch{kind, fd, session, nullptr});
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.ptr = w.get();
+      if (epoll_ctl(shard.epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+         return false;
+      }
+      shard.watches.push_back(std::move(w));
+      return true;
+   }
+
+   void tick(Shard &shard, Session &session, Clock::time_point now) {
+      Clock::time_point next = session.tick(now);
+      if (m_tick) {
+         next = std::min(next, m_tick(session, now));
+      }
+      Clock::time_point &due = shard.due[&session];
+      if (next != due) {
+         due = next;
+         if (next != Clock::time_point::max()) {
+            shard.wheel.schedule(next, Timer{&session, next});
+         }
+      }
+   }
+
+   // points the timerfd at the wheel's earliest entry, if that changed
+   void arm(Shard &shard) {
+      Clock::time_point next = Clock::time_point::max();
+      shard.wheel.next(next);
+      if (next == shard.armed) {
+         return;
+      }
+      shard.armed = next;
+      struct itimerspec spec = {};
+      if (next != Clock::time_point::max()) {
+         auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch()).count();
+         // 0 would disarm the timer
+         ns = std::max<decltype(ns)>(ns, 1);
+         spec.it_value.tv_sec = ns / 1000000000;
+         spec.it_value.tv_nsec = ns % 1000000000;
+      }
+      timerfd_settime(shard.timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+   }
+
+   void loop(Shard &shard) {
+      Realtime::enter(Realtime::Role::IO);
+      const Clock::duration deadline = Realtime::options().deadline;
+      struct epoll_event events[kMaxEvents];
+      while (!m_stopped) {
+         arm(shard);
+         int n = epoll_wait(shard.epfd, events, kMaxEvents, -1);
+         if (n < 0 && errno != EINTR) {
+            LOG_ERROR << "epoll_wait failed: " << strerror(errno);
+            return;
+         }
+         for (int i = 0; i < n && !m_stopped; ++i) {
+            Watch &w = *static_cast<Watch *>(events[i].data.ptr);
+            switch (w.kind) {
+               case Watch::SESSION: {
+                  Session &session = *w.session;
+                  if (events[i].events & EPOLLIN) {
+                     Clock::time_point start = Clock::now();
+                     session.drain(m_handler);
+                     Clock::time_point end = Clock::now();
+                     session.handled(start, end, deadline);
+                     tick(shard, session, end);
+                  }
+                  if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                     // a port that went away would otherwise wake us forever
+                     LOG_ERROR << "Serial port " << session.port() << " hung up";
+                     epoll_ctl(shard.epfd, EPOLL_CTL_DEL, session.fd(), nullptr);
+                  }
+                  break;
+               }
+               case Watch::TIMER:
+               case Watch::WAKE: {
+                  uint64_t count;
+                  ssize_t r = read(w.fd, &count, sizeof(count));
+                  (void) r;
+                  if (w.kind == Watch::TIMER) {
+                     shard.armed = Clock::time_point::max();
+                  } else if (shard.sweep.exchange(false)) {
+                     Clock::time_point now = Clock::now();
+                     for (Session *session : shard.sessions) {
+                        tick(shard, *session, now);
+                     }
+                  }
+                  break;
+               }
+               case Watch::FD:
+                  w.ready();
+                  break;
+            }
+         }
+
+         Clock::time_point now = Clock::now();
+         shard.wheel.advance(now, [this, &shard](const Timer &timer, Clock::time_point now) {
+            Clock::time_point &due = shard.due[timer.session];
+            if (timer.due != due) {
+               return;
+            }
+            if (due > now) {
+               // the wheel does not fire early, but a session that was woken
+               // early anyway must not fall off it
+               shard.wheel.schedule(due, timer);
+               return;
+            }
+            due = Clock::time_point::max();
+            tick(shard, *timer.session, now);
+         });
+      }
+   }
+
+   LineHandler m_handler;
+   TickHandler m_tick;
+   std::vector<std::unique_ptr<Shard>> m_shards;
+   size_t m_next = 0;
+   std::atomic<bool> m_stopped{false};
+};
+
+#endif //AMM_MODULES_REACTOR_H
@@ -0,0 +1,119 @@
+#ifndef AMM_MODULES_REALTIME_H
+#define AMM_MODULES_REALTIME_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "amm_std.h"
+
+// Opt-in low-latency execution for the bridge's own threads (--realtime).
+//
+// Serial I/O threads (reactor shards and port writers) run under SCHED_FIFO
+// at a configurable priority and may be pinned to a set of CPUs; the DDS
+// workers (publisher and conflator) may be pinned to another set but keep
+// the normal scheduler, so they can never starve the serial loop. Threads
+// created inside the DDS library are not ours to move. Every thread calls
+// enter() for its role as it starts; the options must be set before any of
+// them does.
+namespace Realtime {
+
+   enum class Role {
+      IO,
+      WORKER
+   };
+
+   struct Options {
+      bool enabled = false;
+      int priority = 50;
+      std::vector<int> ioCpus;
+      std::vector<int> workerCpus;
+      // handling one wakeup, or waking up, later than this counts as a
+      // missed deadline; checked whether or not realtime mode is on
+      std::chrono::microseconds deadline{1000};
+   };
+
+   inline Options &options() {
+      static Options instance;
+      return instance;
+   }
+
+   // parses a CPU list like "2,4-7"; returns false if it is malformed
+   inline bool parseCpus(const std::string &list, std::vector<int> &cpus) {
+      cpus.clear();
+      const char *p = list.c_str();
+      while (*p) {
+         char *end;
+         long first = strtol(p, &end, 10);
+         if (end == p || first < 0) {
+            return false;
+         }
+         long last = first;
+         p = end;
+         if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+               return false;
+            }
+            p = end;
+         }
+         for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(static_cast<int>(cpu));
+         }
+         if (*p == ',') {
+            ++p;
+         } else if (*p) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   // locks current and future pages so the loop never takes a page fault
+   inline bool lockMemory() {
+      if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+         LOG_WARNING << "mlockall failed: " << strerror(errno);
+         return false;
+      }
+      return true;
+   }
+
+   // Applies the policy for role to the calling thread. A failure (e.g.
+   // missing CAP_SYS_NICE) is logged and the thread carries on as it was.
+   inline void enter(Role role) {
+      const Options &opts = options();
+      if (!opts.enabled) {
+         return;
+      }
+      const std::vector<int> &cpus = role == Role::IO ? opts.ioCpus : opts.workerCpus;
+      if (!cpus.empty()) {
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+         }
+         int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+         if (err != 0) {
+            LOG_WARNING << "Unable to pin thread to its CPUs: " << strerror(err);
+         }
+      }
+      if (role == Role::IO) {
+         struct sched_param param = {};
+         param.sched_priority = opts.priority;
+         int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+         if (err != 0) {
+            LOG_WARNING << "Unable to run serial I/O under SCHED_FIFO: " << strerror(err);
+         }
+      }
+   }
+
+}
+
+#endif //AMM_MODULES_REALTIME_H
@@ -0,0 +1,314 @@
+#ifndef AMM_MODULES_ROUTING_TABLE_H
+#define AMM_MODULES_ROUTING_TABLE_H
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "conflation.h"
+#include "waveform.h"
+#include "wire-topic.h"
+
+// A <topic> from the MCU's subscribed_topics.
+struct Subscription {
+   // subscription key: node path, HF_ node path, modification type or topic name
+   std::string topic;
+   // what the listener sees in the sample, the node path for values and waveforms
+   std::string nodeName;
+   // optional alias the MCU wants the value delivered under
+   std::string mapName;
+   bool waveform = false;
+   // values per second, 0 for every change
+   double maxRate = 0;
+   double deadband = 0;
+   // value_type="float32" in binary mode
+   bool float32 = false;
+   // HF_ only: samples per second after decimation, 0 to keep every sample
+   double rate = 0;
+   // HF_ only: samples per frame, 0 for the default
+   size_t block = 0;
+
+   bool operator==(const Subscription &other) const {
+      return topic == other.topic && nodeName == other.nodeName && mapName == other.mapName &&
+             waveform == other.waveform && maxRate == other.maxRate && deadband == other.deadband &&
+             float32 == other.float32 && rate == other.rate && block == other.block;
+   }
+
+   bool operator!=(const Subscription &other) const {
+      return !(*this == other);
+   }
+};
+
+// One subscribed topic, ready to put on the wire.
+struct Route : WireTopic {
+   std::string topic;
+   // what the MCU asked for, to tell unchanged subscriptions apart
+   Subscription subscription;
+   // set when the topic has a max_rate or deadband
+   std::shared_ptr<ConflationSlot> conflation;
+   // set for every HF_ subscription
+   std::shared_ptr<WaveformSlot> waveform;
+};
+
+// Immutable lookup table compiled from one MCU's subscribed_topics.
+//
+// readHandler builds a fresh table for every capabilities document and
+// publishes it through the RoutingIndex; the DDS listener threads only ever
+// read tables, so a sample costs one hash probe and no locking.
+class RoutingTable {
+public:
+   typedef std::unordered_map<std::string, Route> Routes;
+
+   explicit RoutingTable(Session *owner = nullptr) : m_owner(owner) {}
+
+   // the session whose MCU subscribed
+   Session *owner() const {
+      return m_owner;
+   }
+
+   static constexpr const char *kNodeDataPrefix = "[AMM_Node_Data]";
+   static constexpr const char *kPhysiologyModificationTopic = "AMM_Physiology_Modification";
+   static constexpr const char *kRenderModificationTopic = "AMM_Render_Modification";
+
+   // Adds a subscription. Topic IDs for the binary protocol are handed out in
+   // the order the MCU listed its subscriptions. returns false, and hands out
+   // no ID, for a subscription whose topic the table already routes; the first
+   // one listed stays.
+   //
+   // A subscription that previous already has, unchanged and under the same
+   // ID, keeps its route as is, so its rate limiting and waveform state carry
+   // over when the MCU re-sends its capabilities.
+   bool add(const Subscription &sub, const RoutingTable *previous = nullptr) {
+      Routes &routes = sub.waveform ? m_waveforms : m_routes;
+      const std::string &key = sub.waveform ? sub.nodeName : sub.topic;
+      if (routes.count(key)) {
+         return false;
+      }
+
+      uint16_t id = m_nextId++;
+      const Route *old = previous ? previous->findSubscription(sub) : nullptr;
+      Route route;
+      if (old && old->id == id) {
+         route = *old;
+         ++m_unchanged;
+      } else {
+         route.topic = sub.topic;
+         route.subscription = sub;
+         if (sub.mapName.empty()) {
+            route.prefix = sub.waveform ? "[" + sub.topic + "]" : std::string(kNodeDataPrefix) + sub.nodeName + "=";
+         } else {
+            route.prefix = "[" + sub.mapName + "]";
+         }
+         route.id = id;
+         route.float32 = sub.float32;
+         if (sub.waveform) {
+            route.waveform = std::make_shared<WaveformSlot>(m_owner, route, sub.rate, sub.block);
+         } else if (sub.maxRate > 0 || sub.deadband > 0) {
+            route.conflation = std::make_shared<ConflationSlot>(m_owner, route, sub.maxRate, sub.deadband);
+         }
+      }
+
+      if (sub.topic == kPhysiologyModificationTopic) {
+         m_allPhysiologyModifications = true;
+      } else if (sub.topic == kRenderModificationTopic) {
+         m_allRenderModifications = true;
+      }
+      routes.emplace(key, std::move(route));
+      return true;
+   }
+
+   // node path, modification type or topic name
+   const Route *find(const std::string &topic) const {
+      auto it = m_routes.find(topic);
+      return it == m_routes.end() ? nullptr : &it->second;
+   }
+
+   // keyed by node path without the HF_ marker
+   const Route *findWaveform(const std::string &nodeName) const {
+      auto it = m_waveforms.find(nodeName);
+      return it == m_waveforms.end() ? nullptr : &it->second;
+   }
+
+   // the route for exactly this subscription, if there is one
+   const Route *findSubscription(const Subscription &sub) const {
+      const Route *route = sub.waveform ? findWaveform(sub.nodeName) : find(sub.topic);
+      return route && route->subscription == sub ? route : nullptr;
+   }
+
+   // how many routes were carried over unchanged from the previous table
+   size_t unchanged() const {
+      return m_unchanged;
+   }
+
+   // true if this table routes exactly what previous did
+   bool sameAs(const RoutingTable *previous) const {
+      return previous && m_unchanged == size() && size() == previous->size();
+   }
+
+   bool acceptsPhysiologyModification(const std::string &type) const {
+      return m_allPhysiologyModifications || find(type) != nullptr;
+   }
+
+   bool acceptsRenderModification(const std::string &type) const {
+      return m_allRenderModifications || find(type) != nullptr;
+   }
+
+   bool acceptsAllPhysiologyModifications() const {
+      return m_allPhysiologyModifications;
+   }
+
+   bool acceptsAllRenderModifications() const {
+      return m_allRenderModifications;
+   }
+
+   const Routes &routes() const {
+      return m_routes;
+   }
+
+   const Routes &waveforms() const {
+      return m_waveforms;
+   }
+
+   size_t size() const {
+      return m_routes.size() + m_waveforms.size();
+   }
+
+   // bytes the largest waveform block of this table takes in a frame, 0
+   // without waveforms
+   size_t waveformFrameBytes() const {
+      size_t bytes = 0;
+      for (auto &route : m_waveforms) {
+         bytes = std::max(bytes, route.second.waveform->frameBytes());
+      }
+      return bytes;
+   }
+
+private:
+   Session *m_owner;
+   Routes m_routes;
+   Routes m_waveforms;
+   bool m_allPhysiologyModifications = false;
+   bool m_allRenderModifications = false;
+   uint16_t m_nextId = 0;
+   size_t m_unchanged = 0;
+};
+
+// The routing tables of every session merged into one index, so a DDS sample
+// finds all the ports that want it with a single hash probe.
+//
+// The merged snapshot is immutable and replaced RCU-style: readers take a
+// reference to the snapshot that is live when they start, update() swaps in a
+// new one, and the old snapshot (and the tables it pins) is freed once its
+// last reader lets go.
+class RoutingIndex {
+public:
+   struct Target {
+      Session *session;
+      const RoutingTable *table;
+      const Route *route;
+   };
+   typedef std::vector<Target> Targets;
+
+   class Snapshot {
+   public:
+      // node path, modification type or topic name
+      const Targets *find(const std::string &topic) const {
+         auto it = m_routes.find(topic);
+         return it == m_routes.end() ? nullptr : &it->second;
+      }
+
+      // keyed by node path without the HF_ marker
+      const Targets *findWaveform(const std::string &nodeName) const {
+         auto it = m_waveforms.find(nodeName);
+         return it == m_waveforms.end() ? nullptr : &it->second;
+      }
+
+      // calls f once for every session that takes a modification of this type
+      template<typename F>
+      void forEachPhysiologyModification(const std::string &type, F f) const {
+         forEachModification(m_allPhysiologyModifications, type, f,
+                             &RoutingTable::acceptsAllPhysiologyModifications);
+      }
+
+      template<typename F>
+      void forEachRenderModification(const std::string &type, F f) const {
+         forEachModification(m_allRenderModifications, type, f,
+                             &RoutingTable::acceptsAllRenderModifications);
+      }
+
+      // the tables merged into this snapshot, one per session
+      const std::vector<std::shared_ptr<const RoutingTable>> &tables() const {
+         return m_tables;
+      }
+
+   private:
+      friend class RoutingIndex;
+
+      template<typename F>
+      void forEachModification(const std::vector<Session *> &all, const std::string &type, F &f,
+                               bool (RoutingTable::*acceptsAll)() const) const {
+         for (Session *session : all) {
+            f(*session);
+         }
+         const Targets *targets = find(type);
+         if (targets) {
+            for (const Target &target : *targets) {
+               if (!(target.table->*acceptsAll)()) {
+                  f(*target.session);
+               }
+            }
+         }
+      }
+
+      std::vector<std::shared_ptr<const RoutingTable>> m_tables;
+      std::unordered_map<std::string, Targets> m_routes;
+      std::unordered_map<std::string, Targets> m_waveforms;
+      std::vector<Session *> m_allPhysiologyModifications;
+      std::vector<Session *> m_allRenderModifications;
+   };
+
+   RoutingIndex() : m_snapshot(std::make_shared<const Snapshot>()) {}
+
+   std::shared_ptr<const Snapshot> load() const {
+      return std::atomic_load_explicit(&m_snapshot, std::memory_order_acquire);
+   }
+
+   // Replaces the owning session's table and republishes the merged index.
+   void update(const std::shared_ptr<const RoutingTable> &table) {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_tables[table->owner()] = table;
+
+      std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+      for (auto &entry : m_tables) {
+         const RoutingTable *t = entry.second.get();
+         snapshot->m_tables.push_back(entry.second);
+         for (auto &route : t->routes()) {
+            snapshot->m_routes[route.first].push_back(Target{t->owner(), t, &route.second});
+         }
+         for (auto &route : t->waveforms()) {
+            snapshot->m_waveforms[route.first].push_back(Target{t->owner(), t, &route.second});
+         }
+         if (t->acceptsAllPhysiologyModifications()) {
+            snapshot->m_allPhysiologyModifications.push_back(t->owner());
+         }
+         if (t->acceptsAllRenderModifications()) {
+            snapshot->m_allRenderModifications.push_back(t->owner());
+         }
+      }
+
+      std::atomic_store_explicit(&m_snapshot, std::shared_ptr<const Snapshot>(std::move(snapshot)),
+                                 std::memory_order_release);
+   }
+
+private:
+   std::mutex m_lock;
+   std::map<Session *, std::shared_ptr<const RoutingTable>> m_tables;
+   std::shared_ptr<const Snapshot> m_snapshot;
+};
+
+#endif //AMM_MODULES_ROUTING_TABLE_H
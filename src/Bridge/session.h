@@ -0,0 +1,582 @@
+#ifndef AMM_MODULES_SESSION_H
+#define AMM_MODULES_SESSION_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "amm_std.h"
+
+#include "../Serial/serial-reader.h"
+#include "../Serial/serial-writer.h"
+#include "baud-negotiator.h"
+#include "binary-protocol.h"
+#include "capture.h"
+#include "config-cache.h"
+#include "link-monitor.h"
+#include "message-format.h"
+#include "metrics.h"
+#include "routing-table.h"
+#include "status-cache.h"
+
+// One serial port and the MCU behind it.
+//
+// Holds everything that used to be global for the single port: the fd, its
+// reader and writer, the wire protocol in use and what the MCU told us about
+// itself in its capabilities. DDS listener threads transmit through a session;
+// only the reactor shard that owns it reads from it.
+class Session {
+public:
+   Session(const std::string &port, int baud, const TransmitScheduler &scheduler,
+           const SerialWriter::Caps &caps = SerialWriter::Caps()) :
+      m_port(port), m_baud(baud), m_scheduler(scheduler), m_writer(caps) {}
+
+   Session(const Session &) = delete;
+   Session &operator=(const Session &) = delete;
+
+   ~Session() {
+      close();
+   }
+
+   // Records what is read from and written to the port in log, as port
+   // index; set before open().
+   void capture(CaptureLog *log, uint8_t index) {
+      m_capture = log;
+      m_captureIndex = index;
+      m_writer.capture(log, index);
+   }
+
+   // Returns false if the port could not be opened. lowLatency tunes the tty
+   // for the realtime mode.
+   bool open(bool lowLatency = false) {
+      m_fd = serialport_init(m_port.c_str(), m_baud);
+      if (m_fd == -1) {
+         return false;
+      }
+      if (lowLatency && serialport_low_latency(m_fd) < 0) {
+         LOG_WARNING << "No ASYNC_LOW_LATENCY on " << m_port << ", its driver may hold received bytes back";
+      }
+      m_reader.attach(m_fd);
+      m_writer.start(m_fd, m_scheduler);
+      return true;
+   }
+
+   void close() {
+      if (m_fd != -1) {
+         m_writer.stop();
+         serialport_close(m_fd);
+         m_fd = -1;
+      }
+   }
+
+   const std::string &port() const {
+      return m_port;
+   }
+
+   int fd() const {
+      return m_fd;
+   }
+
+   int baud() const {
+      return m_baud;
+   }
+
+   // Switches the line speed once the control traffic queued so far has
+   // been sent.
+   void changeBaud(int baud) {
+      Frame *frame = acquireFrame(Lane::CONTROL);
+      if (frame) {
+         frame->data.assign(std::to_string(baud));
+         frame->topic = Frame::kBaudTopic;
+         submitFrame(frame);
+         m_baud = baud;
+      }
+   }
+
+   // Pulls whatever the port has and hands every complete text protocol line
+   // to handler(session, line). In binary mode each COBS packet is checked and
+   // TEXT packets are unwrapped first. Text lines are still taken in binary
+   // mode: those the MCU sent before it saw the switch, and everything it sends
+   // after going back to text, e.g. once it reset. A text line after the first
+   // packet means the latter, and switches the bridge back to text.
+   template<typename Handler>
+   void drain(Handler &&handler) {
+      ssize_t n = m_reader.fill();
+      if (n < 0) {
+         LOG_ERROR << " Error reading from serial port " << m_port;
+      } else {
+         m_readerStats.bytes.add(n);
+      }
+      m_lineReceived = LatencyHistogram::Clock::now();
+
+      std::string_view line;
+      bool text;
+      while (nextFrame(line, text)) {
+         m_readerStats.lines.add();
+         if (binaryProtocol && text && m_packetSeen) {
+            LOG_WARNING << "Text line from " << m_port << " after binary packets, switching back to text";
+            switchToText();
+         }
+         if (!text) {
+            if (line.empty()) {
+               continue;
+            }
+            if (!BinaryProtocol::decode(line.data(), line.size(), m_packet)) {
+               ++badFrames;
+               parseError(LineType::BINARY);
+               LOG_WARNING << "Dropping corrupted frame from " << m_port << " (" << badFrames << " so far)";
+               continue;
+            }
+            m_packetSeen = true;
+            if (m_packet[0] != BinaryProtocol::TEXT) {
+               LOG_DEBUG << "Ignoring binary packet type " << static_cast<int>(m_packet[0]);
+               continue;
+            }
+            line = std::string_view(m_packet).substr(1);
+         }
+         if (m_capture) {
+            m_capture->serial(CaptureKind::SERIAL_IN, m_captureIndex, line);
+         }
+         handler(*this, line);
+      }
+   }
+
+   // Hands a line from a capture to handler as if it had just been read off
+   // the port.
+   template<typename Handler>
+   void replay(std::string_view line, Handler &&handler) {
+      m_lineReceived = LatencyHistogram::Clock::now();
+      m_readerStats.lines.add();
+      m_readerStats.bytes.add(line.size());
+      handler(*this, line);
+   }
+
+   // Hot paths format straight into a pooled frame instead of building
+   // strings. The lane decides how the frame competes for the wire.
+   Frame *acquireFrame(Lane lane) {
+      Frame *frame = m_writer.acquire(lane);
+      if (!frame) {
+         LOG_WARNING << "Transmit queue for " << m_port << " full, dropping " << laneName(lane) << " message";
+      }
+      return frame;
+   }
+
+   // for values and waveforms, which are skipped while the port is congested
+   Frame *acquireTelemetry() {
+      if (m_writer.congested()) {
+         m_writer.skipped();
+         return nullptr;
+      }
+      return acquireFrame(Lane::TELEMETRY);
+   }
+
+   // sizes telemetry frames for the largest message the MCU subscribed to,
+   // e.g. a long waveform block
+   void reserveTelemetry(size_t bytes) {
+      m_writer.reserve(Lane::TELEMETRY, bytes);
+   }
+
+   // hands an encoded frame to the serial writer thread without blocking the caller
+   bool submitFrame(Frame *frame) {
+      if (!m_writer.submit(frame)) {
+         LOG_WARNING << "Transmit queue for " << m_port << " full, dropping message";
+         return false;
+      }
+      return true;
+   }
+
+   // sends a text protocol line, wrapped in a TEXT packet in binary mode
+   bool transmit(Frame *frame) {
+      if (binaryProtocol) {
+         thread_local std::string scratch;
+         BinaryProtocol::wrapText(*frame, scratch);
+         frame->binary = true;
+      }
+      return submitFrame(frame);
+   }
+
+   // Confirms the switch to the binary wire protocol with the text line
+   // confirmation and formats everything after it in binary. The serial
+   // writer orders the frames already in flight around the switch.
+   void switchToBinary(const std::string &confirmation) {
+      Frame *frame = acquireFrame(Lane::CONTROL);
+      frame->data.assign(confirmation);
+      frame->topic = Frame::kProtocolTopic;
+      // queued before the flag flips, so the writer sees it before any
+      // frame formatted in binary
+      submitFrame(frame);
+      m_packetSeen = false;
+      binaryProtocol = true;
+   }
+
+   // Goes back to the text protocol after the MCU has. Binary frames still
+   // queued are dropped by the writer.
+   void switchToText() {
+      Frame *frame = acquireFrame(Lane::CONTROL);
+      frame->topic = Frame::kTextTopic;
+      submitFrame(frame);
+      binaryProtocol = false;
+   }
+
+   void transmit(const std::string &message, Lane lane) {
+      Frame *frame = acquireFrame(lane);
+      if (frame) {
+         frame->data.assign(message);
+         transmit(frame);
+      }
+   }
+
+   // keepalive pings are tagged so the writer records when they leave
+   void transmitPing(const std::string &line) {
+      Frame *frame = acquireFrame(Lane::CONTROL);
+      if (frame) {
+         frame->data.assign(line);
+         frame->topic = Frame::kPingTopic;
+         transmit(frame);
+      }
+   }
+
+   SerialWriter::Clock::time_point lastPingWritten() const {
+      return m_writer.lastPingWritten();
+   }
+
+   void setRateScale(double factor) {
+      m_writer.setRateScale(factor);
+   }
+
+   void transmitValue(const WireTopic &topic, double value) {
+      Frame *frame = acquireTelemetry();
+      if (!frame) {
+         return;
+      }
+      frame->topic = topic.id;
+      frame->binary = binaryProtocol;
+      if (frame->binary) {
+         BinaryProtocol::value(*frame, topic.id, value, topic.float32);
+      } else {
+         MessageFormat::value(*frame, topic.prefix, value);
+      }
+      submitFrame(frame);
+   }
+
+   // Streams a static configuration to the MCU.
+   //
+   // Without a config_window every line is queued as fast as the modification
+   // lane takes it and goes out at line rate behind the transmit scheduler;
+   // lines the lane has no room for wait in the transfer and are queued from
+   // tick() as it drains, so a config longer than the lane is never cut
+   // short. With a config_window, the transfer is framed
+   // by [CONFIG]begin=<id>;lines=<n> and [CONFIG]end=<id>, and at most
+   // config_window lines are unacknowledged at any time: the MCU reports how
+   // many lines of the transfer it has consumed with [CONFIG_ACK]id=<id>;count=<n>.
+   // When no ACK arrives for kConfigAckTimeout, the unacknowledged lines are
+   // sent again after [CONFIG]resume=<id>;from=<line>, up to
+   // kConfigAttempts times, and then the transfer fails. A new transfer
+   // abandons the one in progress.
+   void sendConfig(const std::shared_ptr<const ConfigFile> &file) {
+      std::unique_lock<std::mutex> guard(m_configLock);
+      m_config.file = file;
+      m_config.id++;
+      m_config.window = std::max(configWindow.load(), 0);
+      m_config.next = 0;
+      m_config.acked = 0;
+      m_config.begun = false;
+      m_config.ended = false;
+      m_config.resume = false;
+      m_config.retries = 0;
+      m_config.progress = std::chrono::steady_clock::now();
+      pumpConfig();
+      guard.unlock();
+      // the ACK timeout or a full lane has to be watched from now on
+      requestTick();
+   }
+
+   // Set by the reactor: asks the shard that owns the session for a tick
+   // soon, for work started on another thread.
+   void onTickRequest(std::function<void()> request) {
+      m_requestTick = std::move(request);
+   }
+
+   void requestTick() {
+      if (m_requestTick) {
+         m_requestTick();
+      }
+   }
+
+   // the MCU has consumed count lines of transfer id
+   void configAcknowledged(uint32_t id, size_t count) {
+      std::lock_guard<std::mutex> guard(m_configLock);
+      if (!m_config.file || id != m_config.id) {
+         return;
+      }
+      if (count > m_config.acked) {
+         m_config.acked = std::min(count, m_config.next);
+         m_config.progress = std::chrono::steady_clock::now();
+         m_config.retries = 0;
+      }
+      pumpConfig();
+   }
+
+   // Periodic housekeeping from the reactor shard: feeds a transfer that is
+   // waiting for room in its lane and resends or fails one whose ACK is
+   // overdue. returns when the session next needs a tick.
+   std::chrono::steady_clock::time_point tick(std::chrono::steady_clock::time_point now) {
+      std::lock_guard<std::mutex> guard(m_configLock);
+      if (m_config.file && m_config.blocked) {
+         pumpConfig();
+         if (m_config.file && m_config.blocked) {
+            return now + kConfigRetry;
+         }
+      }
+      if (m_config.file && m_config.acked < m_config.next && now - m_config.progress > kConfigAckTimeout) {
+         if (m_config.retries < kConfigAttempts) {
+            ++m_config.retries;
+            LOG_WARNING << "No config ACK from " << m_port << " for transfer " << m_config.id
+                        << ", resending from line " << m_config.acked << " (attempt " << m_config.retries << ")";
+            m_config.next = m_config.acked;
+            m_config.ended = false;
+            m_config.resume = true;
+            m_config.progress = now;
+            pumpConfig();
+         } else {
+            LOG_ERROR << "Config transfer " << m_config.id << " to " << m_port << " failed at line "
+                      << m_config.acked << " of " << m_config.file->lines.size() << ", no ACK after "
+                      << kConfigAttempts << " resends";
+            ++configFailures;
+            m_config.file.reset();
+         }
+      }
+      if (m_config.file && m_config.acked < m_config.next) {
+         return m_config.progress + kConfigAckTimeout + std::chrono::steady_clock::duration(1);
+      }
+      return std::chrono::steady_clock::time_point::max();
+   }
+
+   // Metrics for the read side, called from the line handler.
+   void received(LineType type) {
+      m_readerStats.received[static_cast<size_t>(type)].add();
+   }
+
+   void parseError(LineType type) {
+      m_readerStats.parseErrors[static_cast<size_t>(type)].add();
+   }
+
+   // the reactor spent start..end on one wakeup of the port
+   void handled(LatencyHistogram::Clock::time_point start, LatencyHistogram::Clock::time_point end,
+                LatencyHistogram::Clock::duration deadline) {
+      m_readerStats.handle.record(start, end);
+      if (end - start > deadline) {
+         m_readerStats.missedDeadlines.add();
+      }
+   }
+
+   // when the line being handled was read off the port
+   LatencyHistogram::Clock::time_point lineReceived() const {
+      return m_lineReceived;
+   }
+
+   // the publish queue was full and a message from this port was dropped
+   void publishDropped() {
+      m_readerStats.publishDropped.add();
+   }
+
+   // Called by the DDS publish worker once a message read at received has
+   // been written.
+   void published(LatencyHistogram::Clock::time_point received) {
+      m_readerStats.serialToDds.record(received, LatencyHistogram::Clock::now());
+   }
+
+   const ReaderStats &readerStats() const {
+      return m_readerStats;
+   }
+
+   const WriterStats &writerStats() const {
+      return m_writer.stats();
+   }
+
+   size_t queueDepth() const {
+      return m_writer.depth();
+   }
+
+   size_t queueDepth(Lane lane) const {
+      return m_writer.depth(lane);
+   }
+
+   uint64_t dropped() const {
+      return m_writer.dropped();
+   }
+
+   uint64_t dropped(Lane lane) const {
+      return m_writer.dropped(lane);
+   }
+
+   uint64_t controlOverflow() const {
+      return m_writer.controlOverflow();
+   }
+
+   uint64_t writeErrors() const {
+      return m_writer.writeErrors();
+   }
+
+   uint64_t congestionDrops() const {
+      return m_writer.congestionDrops();
+   }
+
+   void transmitWaveform(const WireTopic &topic, const WaveformBlock &block) {
+      Frame *frame = acquireTelemetry();
+      if (!frame) {
+         return;
+      }
+      frame->topic = topic.id;
+      frame->binary = binaryProtocol;
+      if (frame->binary) {
+         BinaryProtocol::waveform(*frame, topic.id, block);
+      } else {
+         MessageFormat::waveform(*frame, topic.prefix, block);
+      }
+      submitFrame(frame);
+   }
+
+   // What the MCU told us about itself. Only the owning reactor shard touches
+   // these.
+   std::string clientModuleName;
+   bool initializing = true;
+   std::vector<std::string> publishedTopics;
+   std::map<std::string, std::map<std::string, std::string>> equipmentSettings;
+   // the routes currently published for this MCU
+   std::shared_ptr<const RoutingTable> routingTable;
+   // content hash of the last capabilities document, 0 if none yet
+   uint64_t capabilitiesHash = 0;
+   StatusCache statusCache;
+   LinkMonitor link;
+   BaudNegotiator baudNegotiator;
+
+   // lines of config the MCU takes before acknowledging, 0 to send it all at once
+   std::atomic<int> configWindow{0};
+   // windowed transfers abandoned for lack of ACKs
+   std::atomic<uint64_t> configFailures{0};
+
+   // set once the MCU has negotiated the binary wire protocol
+   std::atomic<bool> binaryProtocol{false};
+   uint64_t badFrames = 0;
+
+   static constexpr std::chrono::milliseconds kConfigAckTimeout{1000};
+   // how soon a transfer waiting for room in the modification lane retries
+   static constexpr std::chrono::milliseconds kConfigRetry{10};
+   // resends of an unacknowledged window before a transfer fails
+   static constexpr int kConfigAttempts = 3;
+
+private:
+   struct ConfigTransfer {
+      std::shared_ptr<const ConfigFile> file;
+      uint32_t id = 0;
+      size_t window = 0;
+      size_t next = 0;
+      size_t acked = 0;
+      bool begun = false;
+      bool ended = false;
+      // [CONFIG]resume has to go out before the next line
+      bool resume = false;
+      int retries = 0;
+      // the modification lane was full, the next line waits for tick()
+      bool blocked = false;
+      std::chrono::steady_clock::time_point progress;
+   };
+
+   // queues one line of a config transfer; false if the modification lane
+   // has no room for it right now
+   bool transmitLine(std::string_view line) {
+      Frame *frame = m_writer.tryAcquire(Lane::MODIFICATION);
+      if (!frame) {
+         return false;
+      }
+      frame->data.assign(line.data(), line.size());
+      frame->data.push_back('\n');
+      return transmit(frame);
+   }
+
+   // Queues as much of the transfer as the window and the modification lane
+   // allow; m_configLock held. Without a window every queued line counts as
+   // delivered.
+   void pumpConfig() {
+      const std::vector<std::string_view> &lines = m_config.file->lines;
+      const bool windowed = m_config.window > 0;
+      m_config.blocked = true;
+      if (windowed && !m_config.begun) {
+         if (!transmitLine("[CONFIG]begin=" + std::to_string(m_config.id) + ";lines=" +
+                           std::to_string(lines.size()))) {
+            return;
+         }
+         m_config.begun = true;
+      }
+      if (windowed && m_config.resume) {
+         if (!transmitLine("[CONFIG]resume=" + std::to_string(m_config.id) + ";from=" +
+                           std::to_string(m_config.next))) {
+            return;
+         }
+         m_config.resume = false;
+      }
+      while (m_config.next < lines.size() && (!windowed || m_config.next - m_config.acked < m_config.window)) {
+         if (!transmitLine(lines[m_config.next])) {
+            return;
+         }
+         ++m_config.next;
+         if (!windowed) {
+            m_config.acked = m_config.next;
+         }
+      }
+      if (windowed && m_config.next == lines.size() && !m_config.ended) {
+         if (!transmitLine("[CONFIG]end=" + std::to_string(m_config.id))) {
+            return;
+         }
+         m_config.ended = true;
+      }
+      m_config.blocked = false;
+      if (m_config.acked == lines.size()) {
+         m_config.file.reset();
+      }
+   }
+
+   // Next frame from the reader. In binary mode each frame is framed by how it
+   // starts: a packet's second byte is its type, a control character, while
+   // every text line starts with '[' or "<?" and a printable character.
+   bool nextFrame(std::string_view &line, bool &text) {
+      text = true;
+      if (binaryProtocol) {
+         char head[2];
+         size_t n = m_reader.peek(head, sizeof(head));
+         if (n == 1 && (head[0] == '[' || head[0] == '<')) {
+            return false;
+         }
+         text = n == 2 && (head[0] == '[' || (head[0] == '<' && head[1] == '?')) &&
+                static_cast<unsigned char>(head[1]) >= 0x20;
+      }
+      m_reader.setDelimiter(text ? '\n' : BinaryProtocol::kDelimiter);
+      return m_reader.nextLine(line);
+   }
+
+   std::string m_port;
+   std::atomic<int> m_baud;
+   int m_fd = -1;
+   TransmitScheduler m_scheduler;
+   SerialReader m_reader;
+   SerialWriter m_writer;
+   std::string m_packet;
+   // a valid packet has come in since the switch to binary
+   bool m_packetSeen = false;
+   ReaderStats m_readerStats;
+   LatencyHistogram::Clock::time_point m_lineReceived;
+   std::mutex m_configLock;
+   ConfigTransfer m_config;
+   std::function<void()> m_requestTick;
+   CaptureLog *m_capture = nullptr;
+   uint8_t m_captureIndex = 0;
+};
+
+#endif //AMM_MODULES_SESSION_H
@@ -0,0 +1,109 @@
+#ifndef AMM_MODULES_STATUS_CACHE_H
+#define AMM_MODULES_STATUS_CACHE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include "amm_std.h"
+
+// Last published AMM::Status of every capability behind one port.
+//
+// MCUs report their status periodically whether or not it changed. update()
+// publishes a report only when it is news, and forEachStale() republishes the
+// statuses that have not gone out for a heartbeat period, so modules that join
+// late still learn them. A status counts as published only once the publish
+// callback succeeds; until then its entry is dirty, so the next report
+// publishes it again and forEachStale() retries it after kRetry. Only the
+// reactor shard that owns the port touches its cache.
+class StatusCache {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   // how soon forEachStale() retries a status whose publish failed
+   static constexpr Clock::duration kRetry = std::chrono::milliseconds(100);
+
+   // maps the status attribute of an AMMModuleStatus capability
+   struct Mapping {
+      const char *name;
+      AMM::StatusValue value;
+   };
+
+   static constexpr Mapping kMappings[] = {
+      {"OPERATIONAL", AMM::StatusValue::OPERATIONAL},
+      {"HALTING_ERROR", AMM::StatusValue::INOPERATIVE},
+      {"IMPENDING_ERROR", AMM::StatusValue::EXIGENT},
+   };
+
+   // returns false for a status name the protocol does not know
+   static bool map(const char *name, AMM::StatusValue &value) {
+      for (const Mapping &mapping : kMappings) {
+         if (name && !strcmp(name, mapping.name)) {
+            value = mapping.value;
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // Calls publish, which returns whether the status went out, if the value or
+   // message of status differ from what was last published for that module
+   // and capability, or if its last publish failed. Returns whether it did.
+   template<typename F>
+   bool update(const AMM::Status &status, Clock::time_point now, F publish) {
+      Entry &entry = m_entries[status.module_name() + "/" + status.capability()];
+      if (entry.known && !entry.dirty && entry.status.value() == status.value() &&
+          entry.status.message() == status.message()) {
+         return false;
+      }
+      entry.known = true;
+      entry.status = status;
+      entry.published = now;
+      entry.dirty = !publish(entry.status);
+      return true;
+   }
+
+   // calls publish for every status not published within period, or whose
+   // last publish failed at least kRetry ago
+   template<typename F>
+   void forEachStale(Clock::time_point now, Clock::duration period, F publish) {
+      for (auto &item : m_entries) {
+         Entry &entry = item.second;
+         if (entry.known && now >= due(entry, period)) {
+            entry.published = now;
+            entry.dirty = !publish(entry.status);
+         }
+      }
+   }
+
+   // when forEachStale() next finds a stale status
+   Clock::time_point nextStale(Clock::duration period) const {
+      Clock::time_point next = Clock::time_point::max();
+      for (const auto &item : m_entries) {
+         if (item.second.known) {
+            next = std::min(next, due(item.second, period));
+         }
+      }
+      return next;
+   }
+
+private:
+   struct Entry {
+      bool known = false;
+      AMM::Status status;
+      // when it was last published, or last tried if dirty
+      Clock::time_point published;
+      // the last publish failed
+      bool dirty = false;
+   };
+
+   static Clock::time_point due(const Entry &entry, Clock::duration period) {
+      return entry.published + (entry.dirty ? std::min(period, kRetry) : period);
+   }
+
+   std::map<std::string, Entry> m_entries;
+};
+
+#endif //AMM_MODULES_STATUS_CACHE_H
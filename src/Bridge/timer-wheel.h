@@ -0,0 +1,153 @@
+#ifndef AMM_MODULES_TIMER_WHEEL_H
+#define AMM_MODULES_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Hierarchical timer wheel (Varghese and Lauck).
+//
+// Four levels of 64 slots each; a slot of level 0 spans one tick, a slot of
+// level n spans 64^n ticks, so with the default 1 ms tick the wheel reaches
+// four and a half hours ahead and anything later waits in the last level.
+// schedule() is O(1), and advance() fires due entries in time order,
+// cascading entries down a level as the lower one wraps. There is no cancel:
+// owners that reschedule keep a generation or deadline of their own and
+// ignore entries that no longer match when they fire. Not thread-safe.
+template<typename T>
+class TimerWheel {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   static const int kLevels = 4;
+   static const int kSlotBits = 6;
+   static const uint64_t kSlots = 1 << kSlotBits;
+
+   explicit TimerWheel(Clock::time_point origin = Clock::now(),
+                       Clock::duration tick = std::chrono::milliseconds(1)) :
+      m_origin(origin), m_tick(tick) {}
+
+   // value fires at the first advance() at or after when; an entry scheduled
+   // while firing fires no sooner than the next tick
+   void schedule(Clock::time_point when, T value) {
+      insert(Entry{std::max(ticks(when), m_current + (m_firing ? 1 : 0)), std::move(value)});
+      ++m_size;
+   }
+
+   // Fires fire(value, now) for every entry due by now. fire may schedule
+   // new entries.
+   template<typename F>
+   void advance(Clock::time_point now, F &&fire) {
+      uint64_t target = elapsed(now);
+      while (m_current <= target) {
+         if (m_size == 0) {
+            m_current = target + 1;
+            return;
+         }
+         std::vector<Entry> due;
+         due.swap(m_slots[0][m_current & (kSlots - 1)]);
+         m_firing = true;
+         for (Entry &entry : due) {
+            --m_size;
+            fire(entry.value, now);
+         }
+         m_firing = false;
+         ++m_current;
+         cascade();
+      }
+   }
+
+   // Earliest time an entry may be due, for arming a timer. Entries still on
+   // a higher level report the start of their slot, which is when they
+   // cascade. returns false when the wheel is empty.
+   bool next(Clock::time_point &when) const {
+      if (m_size == 0) {
+         return false;
+      }
+      uint64_t best = UINT64_MAX;
+      for (uint64_t i = 0; i < kSlots; ++i) {
+         if (!m_slots[0][(m_current + i) & (kSlots - 1)].empty()) {
+            best = m_current + i;
+            break;
+         }
+      }
+      for (int level = 1; level < kLevels; ++level) {
+         uint64_t base = m_current >> (kSlotBits * level);
+         for (uint64_t i = 1; i <= kSlots; ++i) {
+            if (!m_slots[level][(base + i) & (kSlots - 1)].empty()) {
+               best = std::min(best, (base + i) << (kSlotBits * level));
+               break;
+            }
+         }
+      }
+      when = m_origin + m_tick * static_cast<Clock::rep>(best);
+      return true;
+   }
+
+   size_t size() const {
+      return m_size;
+   }
+
+private:
+   struct Entry {
+      uint64_t tick;
+      T value;
+   };
+
+   // tick an entry due at when goes in, rounded up
+   uint64_t ticks(Clock::time_point when) const {
+      if (when <= m_origin) {
+         return 0;
+      }
+      return static_cast<uint64_t>((when - m_origin + m_tick - Clock::duration(1)) / m_tick);
+   }
+
+   // last tick that has fully started by now, rounded down; together with
+   // ticks() this keeps an entry from ever firing before when
+   uint64_t elapsed(Clock::time_point now) const {
+      if (now <= m_origin) {
+         return 0;
+      }
+      return static_cast<uint64_t>((now - m_origin) / m_tick);
+   }
+
+   void insert(Entry entry) {
+      uint64_t delta = entry.tick - m_current;
+      for (int level = 0; level < kLevels; ++level) {
+         if (delta < (kSlots << (kSlotBits * level))) {
+            m_slots[level][(entry.tick >> (kSlotBits * level)) & (kSlots - 1)].push_back(std::move(entry));
+            return;
+         }
+      }
+      // beyond the wheel: park in the farthest slot and re-place on cascade
+      uint64_t farthest = m_current + (kSlots << (kSlotBits * (kLevels - 1))) - 1;
+      m_slots[kLevels - 1][(farthest >> (kSlotBits * (kLevels - 1))) & (kSlots - 1)].push_back(std::move(entry));
+   }
+
+   // moves the entries of the next slot of each level that just wrapped
+   // down to where they now belong
+   void cascade() {
+      for (int level = 1; level < kLevels; ++level) {
+         if (m_current & ((uint64_t(1) << (kSlotBits * level)) - 1)) {
+            return;
+         }
+         std::vector<Entry> moving;
+         moving.swap(m_slots[level][(m_current >> (kSlotBits * level)) & (kSlots - 1)]);
+         for (Entry &entry : moving) {
+            insert(std::move(entry));
+         }
+      }
+   }
+
+   Clock::time_point m_origin;
+   Clock::duration m_tick;
+   uint64_t m_current = 0;
+   size_t m_size = 0;
+   bool m_firing = false;
+   std::vector<Entry> m_slots[kLevels][kSlots];
+};
+
+#endif //AMM_MODULES_TIMER_WHEEL_H
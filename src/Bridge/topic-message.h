@@ -0,0 +1,153 @@
+#ifndef AMM_MODULES_TOPIC_MESSAGE_H
+#define AMM_MODULES_TOPIC_MESSAGE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+
+// Topics an MCU may publish with a generic [Topic]k=v;k=v line.
+enum class InboundTopic : uint8_t {
+   UNKNOWN,
+   RENDER_MODIFICATION,
+   PHYSIOLOGY_MODIFICATION,
+   PERFORMANCE_ASSESSMENT,
+   DIAGNOSTICS_LOG_RECORD
+};
+
+// Compile-time perfect hash of the inbound topic names. The names are placed
+// by FNV-1a modulo kSlots when the header is compiled and a static_assert
+// guarantees they do not collide, so a lookup is one hash and one compare.
+namespace TopicTable {
+
+   struct Entry {
+      std::string_view name;
+      InboundTopic topic;
+   };
+
+   static constexpr size_t kSlots = 16;
+
+   static constexpr Entry kTopics[] = {
+      {"AMM_Render_Modification", InboundTopic::RENDER_MODIFICATION},
+      {"AMM_Physiology_Modification", InboundTopic::PHYSIOLOGY_MODIFICATION},
+      {"AMM_Performance_Assessment", InboundTopic::PERFORMANCE_ASSESSMENT},
+      {"AMM_Diagnostics_Log_Record", InboundTopic::DIAGNOSTICS_LOG_RECORD},
+   };
+
+   // FNV-1a
+   constexpr uint32_t hash(std::string_view s) {
+      uint32_t h = 2166136261u;
+      for (char c : s) {
+         h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+      }
+      return h;
+   }
+
+   constexpr std::array<Entry, kSlots> build() {
+      std::array<Entry, kSlots> table{};
+      for (const Entry &entry : kTopics) {
+         table[hash(entry.name) % kSlots] = entry;
+      }
+      return table;
+   }
+
+   constexpr bool collisionFree() {
+      for (size_t i = 0; i < std::size(kTopics); ++i) {
+         for (size_t j = i + 1; j < std::size(kTopics); ++j) {
+            if (hash(kTopics[i].name) % kSlots == hash(kTopics[j].name) % kSlots) {
+               return false;
+            }
+         }
+      }
+      return true;
+   }
+
+   static_assert(collisionFree(), "inbound topic names collide, change kSlots");
+
+   static constexpr std::array<Entry, kSlots> kTable = build();
+
+   inline InboundTopic lookup(std::string_view topic) {
+      const Entry &entry = kTable[hash(topic) % kSlots];
+      return !entry.name.empty() && entry.name == topic ? entry.topic : InboundTopic::UNKNOWN;
+   }
+
+}
+
+// One generic topic line, parsed in place.
+//
+// parse() makes a single pass over the line and leaves every field as a view
+// into it, so nothing is copied or allocated; the views are only valid while
+// the line is. Empty tokens are skipped and a repeated key keeps its last
+// value. Keys other than type, location, info and payload are ignored.
+struct TopicMessage {
+   std::string_view topic;
+   std::string_view type;
+   std::string_view location;
+   std::string_view info;
+   std::string_view payload;
+
+   // returns false if line is not of the form [Topic]...
+   static bool parse(std::string_view line, TopicMessage &out) {
+      out = TopicMessage();
+      if (line.empty() || line[0] != '[') {
+         return false;
+      }
+      size_t close = line.find(']', 1);
+      if (close == std::string_view::npos) {
+         return false;
+      }
+      out.topic = line.substr(1, close - 1);
+
+      const char *p = line.data() + close + 1;
+      const char *end = line.data() + line.size();
+      while (p < end) {
+         const char *token = p;
+         const char *equals = nullptr;
+         while (p < end && *p != ';') {
+            if (!equals && *p == '=') {
+               equals = p;
+            }
+            ++p;
+         }
+         if (p > token) {
+            std::string_view key(token, (equals ? equals : p) - token);
+            std::string_view value = equals ? std::string_view(equals + 1, p - equals - 1) : std::string_view();
+            out.assign(key, value);
+         }
+         ++p;
+      }
+      return true;
+   }
+
+   static InboundTopic lookup(std::string_view topic) {
+      return TopicTable::lookup(topic);
+   }
+
+private:
+   void assign(std::string_view key, std::string_view value) {
+      switch (key.size()) {
+         case 4:
+            if (key == "type") {
+               type = value;
+            } else if (key == "info") {
+               info = value;
+            }
+            break;
+         case 7:
+            if (key == "payload") {
+               payload = value;
+            }
+            break;
+         case 8:
+            if (key == "location") {
+               location = value;
+            }
+            break;
+         default:
+            break;
+      }
+   }
+};
+
+#endif //AMM_MODULES_TOPIC_MESSAGE_H
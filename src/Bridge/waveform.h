@@ -0,0 +1,152 @@
+#ifndef AMM_MODULES_WAVEFORM_H
+#define AMM_MODULES_WAVEFORM_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "wire-topic.h"
+
+class Session;
+
+// A run of consecutive waveform samples that goes out as one frame.
+struct WaveformBlock {
+   // bridge monotonic time at which the first sample was received, in
+   // microseconds, not the source timestamp; wraps every 71 minutes, the MCU
+   // only needs differences
+   uint32_t start = 0;
+   // mean spacing of the samples in microseconds
+   uint32_t interval = 0;
+   std::vector<float> samples;
+};
+
+// Decimates and batches one HF_ waveform subscription.
+//
+// The DDS waveform topic delivers one sample per callback, far more often than
+// a serial link can carry a line each. Samples are first thinned to the
+// subscription's target rate, then collected until a block of block_size is
+// full, which is handed back to the caller to put on the wire in one frame.
+// A block that is still short after maxAge() goes out as it is through
+// expire(), so a source that slows down or stops does not hold back its last
+// samples. Sample times are taken when the bridge receives them, not when the
+// source produced them, and travel with the block as its start time and mean
+// interval, so DDS delivery jitter shows up in them.
+class WaveformSlot {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   static constexpr size_t kDefaultBlock = 10;
+   // larger requests are cut to this; frames are sized for the block the
+   // subscription ends up with, see frameBytes()
+   static constexpr size_t kMaxBlock = 64;
+   // widest sample in a text block, "-1.23457e-05" and its comma
+   static constexpr size_t kMaxSampleText = 13;
+   // the rest of a text block besides its prefix: "t=<u32>;dt=<u32>;v=", the
+   // newline and the TEXT packet around it on a binary link
+   static constexpr size_t kBlockOverhead = 40;
+   // a block may wait this long for its last samples, or twice the time a
+   // full block takes at the target rate if that is longer
+   static constexpr std::chrono::milliseconds kDefaultMaxAge{100};
+
+   enum class Offer {
+      // decimated away, or added to a block already waiting
+      KEPT,
+      // the first sample of a new block, which expires at maxAge() from now
+      STARTED,
+      // completed a block
+      FULL
+   };
+
+   WaveformSlot(Session *owner, const WireTopic &wireTopic, double rate, size_t block) :
+      session(owner), wire(wireTopic),
+      m_block(block == 0 ? kDefaultBlock : std::min(block, kMaxBlock)) {
+      if (rate > 0) {
+         m_period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate));
+      }
+      m_maxAge = std::max<Clock::duration>(kDefaultMaxAge, m_period * static_cast<Clock::rep>(2 * m_block));
+      m_pending.samples.reserve(m_block);
+   }
+
+   // port the block goes out on
+   Session *const session;
+   const WireTopic wire;
+
+   size_t block() const {
+      return m_block;
+   }
+
+   Clock::duration maxAge() const {
+      return m_maxAge;
+   }
+
+   // bytes the largest frame of this subscription can take, text being wider
+   // than binary
+   size_t frameBytes() const {
+      return wire.prefix.size() + kBlockOverhead + m_block * kMaxSampleText;
+   }
+
+   // Adds a sample received at now. A completed block is swapped into out;
+   // out's old buffer is reused for the next block so steady-state streaming
+   // does not allocate.
+   Offer offer(double value, Clock::time_point now, WaveformBlock &out) {
+      std::lock_guard<std::mutex> guard(m_lock);
+      if (now < m_nextSample) {
+         return Offer::KEPT;
+      }
+      // keep to the target rate without drifting when samples arrive late
+      m_nextSample = m_nextSample + m_period > now ? m_nextSample + m_period : now + m_period;
+
+      bool started = m_pending.samples.empty();
+      if (started) {
+         m_first = now;
+      }
+      m_pending.samples.push_back(static_cast<float>(value));
+      m_last = now;
+      if (m_pending.samples.size() < m_block) {
+         return started ? Offer::STARTED : Offer::KEPT;
+      }
+      finish(out);
+      return Offer::FULL;
+   }
+
+   // Hands out the waiting block as it is if it has been waiting for
+   // maxAge() by now. returns false if there is none, or it is younger; a
+   // block started after the one the caller timed is left to its own expiry.
+   bool expire(Clock::time_point now, WaveformBlock &out) {
+      std::lock_guard<std::mutex> guard(m_lock);
+      if (m_pending.samples.empty() || now - m_first < m_maxAge) {
+         return false;
+      }
+      finish(out);
+      return true;
+   }
+
+private:
+   static uint64_t micros(Clock::duration d) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+   }
+
+   void finish(WaveformBlock &out) {
+      m_pending.start = static_cast<uint32_t>(micros(m_first.time_since_epoch()));
+      size_t gaps = m_pending.samples.size() - 1;
+      m_pending.interval = static_cast<uint32_t>(gaps ? micros(m_last - m_first) / gaps : micros(m_period));
+      std::swap(m_pending, out);
+      m_pending.samples.clear();
+      m_pending.samples.reserve(m_block);
+   }
+
+   const size_t m_block;
+   Clock::duration m_period = Clock::duration::zero();
+   Clock::duration m_maxAge;
+
+   std::mutex m_lock;
+   Clock::time_point m_nextSample;
+   Clock::time_point m_first;
+   Clock::time_point m_last;
+   WaveformBlock m_pending;
+};
+
+#endif //AMM_MODULES_WAVEFORM_H
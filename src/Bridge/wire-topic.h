@@ -0,0 +1,17 @@
+#ifndef AMM_MODULES_WIRE_TOPIC_H
+#define AMM_MODULES_WIRE_TOPIC_H
+
+#include <cstdint>
+#include <string>
+
+// How a subscribed value is addressed on the wire.
+struct WireTopic {
+   // text protocol prefix, "[map_name]" or "[AMM_Node_Data]name="
+   std::string prefix;
+   // binary protocol topic ID, the topic's position in the MCU's subscriptions
+   uint16_t id = 0;
+   // binary protocol payload is float32 instead of float64
+   bool float32 = false;
+};
+
+#endif //AMM_MODULES_WIRE_TOPIC_H
@@ -7,11 +7,144 @@
 #include <errno.h>    // Error number definitions
 #include <termios.h>  // POSIX terminal control definitions
 #include <cstring>   // String function definitions
+#include <cstdio>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <asm/ioctls.h>
+#include <linux/serial.h>
+#endif
 
 // uncomment this to debug reads
 // #define SERIALPORTDEBUG
 
+// maps a baud rate to its termios constant; B0 if there is none
+static speed_t serialport_speed(int baud)
+{
+    switch(baud) {
+        case 4800:    return B4800;
+        case 9600:    return B9600;
+#ifdef B14400
+        case 14400:   return B14400;
+#endif
+        case 19200:   return B19200;
+#ifdef B28800
+        case 28800:   return B28800;
+#endif
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+#ifdef B230400
+        case 230400:  return B230400;
+#endif
+#ifdef B460800
+        case 460800:  return B460800;
+#endif
+#ifdef B500000
+        case 500000:  return B500000;
+#endif
+#ifdef B576000
+        case 576000:  return B576000;
+#endif
+#ifdef B921600
+        case 921600:  return B921600;
+#endif
+#ifdef B1000000
+        case 1000000: return B1000000;
+#endif
+#ifdef B1152000
+        case 1152000: return B1152000;
+#endif
+#ifdef B1500000
+        case 1500000: return B1500000;
+#endif
+#ifdef B2000000
+        case 2000000: return B2000000;
+#endif
+#ifdef B2500000
+        case 2500000: return B2500000;
+#endif
+#ifdef B3000000
+        case 3000000: return B3000000;
+#endif
+#ifdef B3500000
+        case 3500000: return B3500000;
+#endif
+#ifdef B4000000
+        case 4000000: return B4000000;
+#endif
+    }
+    return B0;
+}
+
+#if defined(__linux__) && defined(TCGETS2)
+// struct termios2 from <asm/termbits.h>, which can't be included next to
+// <termios.h>. It carries the line speed as a plain integer, so with BOTHER
+// any rate the UART's divisor can produce is accepted.
+struct serialport_termios2 {
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+
+static int serialport_set_baud_other(int fd, int baud)
+{
+    struct serialport_termios2 tio;
+    if( ioctl(fd, _IOR('T', 0x2A, struct serialport_termios2), &tio) < 0 ) {
+        perror("serialport_set_baud: Couldn't get termios2");
+        return -1;
+    }
+    tio.c_cflag &= ~CBAUD;
+    tio.c_cflag |= BOTHER;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+    if( ioctl(fd, _IOW('T', 0x2B, struct serialport_termios2), &tio) < 0 ) {
+        perror("serialport_set_baud: Couldn't set termios2");
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+// Sets both directions of an open port to baud. Rates with a termios constant
+// go through cfsetispeed/cfsetospeed; any other rate (e.g. 250000 or 3686400) needs termios2 and
+// fails on systems without it. returns 0, or -1 on error
+int serialport_set_baud(int fd, int baud)
+{
+    speed_t brate = serialport_speed(baud);
+    if( brate == B0 ) {
+#if defined(__linux__) && defined(TCGETS2)
+        return baud > 0 ? serialport_set_baud_other(fd, baud) : -1;
+#else
+        fprintf(stderr, "serialport_set_baud: %d baud not supported\n", baud);
+        return -1;
+#endif
+    }
+
+    struct termios toptions;
+    if( tcgetattr(fd, &toptions) < 0 ) {
+        perror("serialport_set_baud: Couldn't get term attributes");
+        return -1;
+    }
+    cfsetispeed(&toptions, brate);
+    cfsetospeed(&toptions, brate);
+    if( tcsetattr(fd, TCSANOW, &toptions) < 0 ) {
+        perror("serialport_set_baud: Couldn't set term attributes");
+        return -1;
+    }
+    return 0;
+}
+
 // takes the string name of the serial port (e.g. "/dev/tty.usbserial","COM1")
 // and a baud rate (bps) and connects to that port at that speed and 8N1.
 // opens the port in fully raw mode so you can send binary data.
@@ -37,24 +170,6 @@ int serialport_init(const char* serialport, int baud)
         perror("serialport_init: Couldn't get term attributes");
         return -1;
     }
-    speed_t brate = baud; // let you override switch below if needed
-    switch(baud) {
-        case 4800:   brate=B4800;   break;
-        case 9600:   brate=B9600;   break;
-#ifdef B14400
-            case 14400:  brate=B14400;  break;
-#endif
-        case 19200:  brate=B19200;  break;
-#ifdef B28800
-            case 28800:  brate=B28800;  break;
-#endif
-        case 38400:  brate=B38400;  break;
-        case 57600:  brate=B57600;  break;
-        case 115200: brate=B115200; break;
-    }
-    cfsetispeed(&toptions, brate);
-    cfsetospeed(&toptions, brate);
-
     // 8N1
     toptions.c_cflag &= ~PARENB;
     toptions.c_cflag &= ~CSTOPB;
@@ -82,9 +197,39 @@ int serialport_init(const char* serialport, int baud)
         return -1;
     }
 
+    if( serialport_set_baud(fd, baud) < 0 ) {
+        close(fd);
+        return -1;
+    }
+
     return fd;
 }
 
+// Tunes an open port for latency over throughput: with ASYNC_LOW_LATENCY the
+// UART driver hands every received byte up at once instead of batching them
+// on a timer, which USB serial adapters otherwise do for up to 16 ms. The port
+// is nonblocking and read when poll() says so, so VMIN/VTIME play no part.
+// returns 0, or -1 if the driver does not support the flag (e.g. a pty) or
+// refused it
+int serialport_low_latency(int fd)
+{
+#ifdef ASYNC_LOW_LATENCY
+    struct serial_struct serial;
+    if( ioctl(fd, TIOCGSERIAL, &serial) < 0 ) {
+        return -1;
+    }
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if( ioctl(fd, TIOCSSERIAL, &serial) < 0 ) {
+        perror("serialport_low_latency: Couldn't set ASYNC_LOW_LATENCY");
+        return -1;
+    }
+    return 0;
+#else
+    (void) fd;
+    return -1;
+#endif
+}
+
 //
 int serialport_close( int fd )
 {
@@ -100,14 +245,45 @@ int serialport_writebyte( int fd, uint8_t b)
     return 0;
 }
 
-//
+// writes len bytes of buf, for callers that already know the length; returns
+// how many bytes went out (fewer on a short write) or -1 with errno set
+ssize_t serialport_write_len(int fd, const char* buf, size_t len)
+{
+    return write(fd, buf, len);
+}
+
+// gathers cnt buffers into one write; same return as serialport_write_len
+ssize_t serialport_writev(int fd, const struct iovec* iov, int cnt)
+{
+    return writev(fd, iov, cnt);
+}
+
+// writes the whole string, waiting for the port to drain when it is full
+// rather than dropping what did not fit
 int serialport_write(int fd, const char* str)
 {
-    int len = strlen(str);
-    int n = write(fd, str, len);
-    if( n!=len ) {
-        perror("serialport_write: couldn't write whole string\n");
-        return -1;
+    size_t len = strlen(str);
+    size_t done = 0;
+    while( done < len ) {
+        ssize_t n = serialport_write_len(fd, str + done, len - done);
+        if( n > 0 ) {
+            done += n;
+            continue;
+        }
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+            perror("serialport_write: couldn't write whole string\n");
+            return -1;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if( poll(&pfd, 1, -1) < 0 && errno != EINTR ) {
+            perror("serialport_write: couldn't wait for the port\n");
+            return -1;
+        }
     }
     return 0;
 }
@@ -0,0 +1,164 @@
+#ifndef AMM_MODULES_SERIAL_READER_H
+#define AMM_MODULES_SERIAL_READER_H
+
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Poll-driven bulk reader for a nonblocking serial fd.
+//
+// Instead of one read() per byte, wait() blocks in poll() until the kernel has
+// data, fill() pulls everything that is available with a single readv() into a
+// preallocated ring, and nextLine() frames delimiter-terminated lines out of it.
+// Bytes of a line that has not been terminated yet stay in the ring until the
+// rest of it arrives, so a long line (e.g. a capabilities document) may span
+// any number of reads.
+class SerialReader {
+public:
+   // must be a power of two
+   static const size_t kCapacity = 16384;
+
+   explicit SerialReader(int fd = -1, char delimiter = '\n') :
+      m_fd(fd), m_delimiter(delimiter), m_ring(new char[kCapacity]) {}
+
+   void attach(int fd) {
+      m_fd = fd;
+      reset();
+   }
+
+   // switches framing, e.g. to 0x00 for COBS packets; buffered bytes are
+   // rescanned with the new delimiter
+   void setDelimiter(char delimiter) {
+      if (delimiter != m_delimiter) {
+         m_delimiter = delimiter;
+         m_scan = m_head;
+      }
+   }
+
+   void reset() {
+      m_head = m_tail = m_scan = 0;
+   }
+
+   // Waits up to timeoutMs for the port to become readable.
+   // returns 1 when readable, 0 on timeout, -1 on error or hangup
+   int wait(int timeoutMs) {
+      struct pollfd pfd;
+      pfd.fd = m_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int n = poll(&pfd, 1, timeoutMs);
+      if (n < 0) {
+         return errno == EINTR ? 0 : -1;
+      }
+      if (n == 0) {
+         return 0;
+      }
+      if (pfd.revents & POLLIN) {
+         return 1;
+      }
+      return -1;
+   }
+
+   // Reads everything the kernel currently holds (up to the free space in the
+   // ring) with one syscall.
+   // returns number of bytes read, 0 if nothing was pending, -1 on error
+   ssize_t fill() {
+      size_t used = m_tail - m_head;
+      if (used == kCapacity) {
+         return 0;
+      }
+      size_t start = m_tail & (kCapacity - 1);
+      size_t space = kCapacity - used;
+      struct iovec iov[2];
+      int iovcnt = 1;
+      iov[0].iov_base = m_ring.get() + start;
+      iov[0].iov_len = std::min(space, kCapacity - start);
+      if (iov[0].iov_len < space) {
+         iov[1].iov_base = m_ring.get();
+         iov[1].iov_len = space - iov[0].iov_len;
+         iovcnt = 2;
+      }
+
+      ssize_t n = readv(m_fd, iov, iovcnt);
+      if (n < 0) {
+         return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+      }
+      m_tail += n;
+      return n;
+   }
+
+   // Pops the next complete line (without its delimiter). The view points
+   // straight into the ring and is only valid until the next call to fill() or
+   // nextLine(); only a line that wraps around the end of the ring is copied.
+   // A full ring without any delimiter is handed out as one line so a runaway
+   // sender cannot wedge the reader.
+   bool nextLine(std::string_view &line) {
+      while (m_scan != m_tail) {
+         // search the contiguous run up to the write position or the ring's end
+         size_t start = m_scan & (kCapacity - 1);
+         size_t run = std::min(m_tail - m_scan, kCapacity - start);
+         const char *scanPos = m_ring.get() + start;
+         const char *hit = static_cast<const char *>(memchr(scanPos, m_delimiter, run));
+         if (hit) {
+            m_scan += hit - scanPos;
+            line = view(m_scan - m_head);
+            m_head = ++m_scan;
+            return true;
+         }
+         m_scan += run;
+      }
+      if (m_tail - m_head == kCapacity) {
+         line = view(kCapacity);
+         m_head = m_scan = m_tail;
+         return true;
+      }
+      return false;
+   }
+
+   size_t buffered() const {
+      return m_tail - m_head;
+   }
+
+   // copies up to len bytes from the start of the next line into out without
+   // consuming them; returns how many were copied
+   size_t peek(char *out, size_t len) const {
+      len = std::min(len, buffered());
+      for (size_t i = 0; i < len; ++i) {
+         out[i] = m_ring[(m_head + i) & (kCapacity - 1)];
+      }
+      return len;
+   }
+
+private:
+   std::string_view view(size_t len) {
+      size_t start = m_head & (kCapacity - 1);
+      size_t first = std::min(len, kCapacity - start);
+      if (first == len) {
+         return std::string_view(m_ring.get() + start, len);
+      }
+      m_wrapped.assign(m_ring.get() + start, first);
+      m_wrapped.append(m_ring.get(), len - first);
+      return m_wrapped;
+   }
+
+   int m_fd;
+   char m_delimiter;
+   std::unique_ptr<char[]> m_ring;
+   // linearized copy of a line that wraps around the end of the ring
+   std::string m_wrapped;
+
+   // monotonically increasing positions, masked on access
+   size_t m_head = 0;
+   size_t m_tail = 0;
+   size_t m_scan = 0;
+};
+
+#endif //AMM_MODULES_SERIAL_READER_H
@@ -0,0 +1,592 @@
+#ifndef AMM_MODULES_SERIAL_WRITER_H
+#define AMM_MODULES_SERIAL_WRITER_H
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include "arduino-serial-lib.h"
+}
+
+#include "amm_std.h"
+
+#include "transmit-scheduler.h"
+#include "../Bridge/binary-protocol.h"
+#include "../Bridge/capture.h"
+#include "../Bridge/frame-pool.h"
+#include "../Bridge/metrics.h"
+#include "../Bridge/mpsc-queue.h"
+#include "../Bridge/realtime.h"
+
+// Dedicated writer thread that owns the write side of the serial port.
+//
+// Any thread may acquire() a frame for one of the outbound lanes, format into
+// it and submit() it; neither waits on the UART. Each lane has its own pool
+// of frames, capped per lane, so a backlog in one never takes memory from
+// another. The writer thread serves the lanes in strict priority, each in
+// order, paced by a TransmitScheduler, and sleeps in poll() on an eventfd when
+// there is nothing to send. Producers only pay for the eventfd write when the
+// writer is actually asleep.
+//
+// MODIFICATION and TELEMETRY frames travel through lock-free queues. CONTROL
+// is rare and must never be dropped, so its queue is a mutex-guarded ring
+// and frames past its cap are allocated rather than refused.
+//
+// Switches of the wire protocol are ordered here too. Producers tag every
+// frame with the encoding they formatted it in. The writer flips its own
+// encoding when it sends the Frame::kProtocolTopic line, and back when it
+// reaches a Frame::kTextTopic frame. A frame in the other encoding waits while
+// a switch is queued, since it was formatted after that switch. Otherwise it
+// predates the last switch: a text frame is wrapped in a TEXT packet, and a
+// binary frame, which an MCU that went back to text cannot read, is dropped.
+// So the MCU never sees text while it expects binary, or binary before it
+// does.
+//
+// Every frame the scheduler admits at once goes out in a single writev().
+// When the tty buffer fills up, the unwritten rest of the batch is kept with
+// the offset reached in its first frame and the writer waits for POLLOUT, so
+// a saturated UART delays bytes but never loses them.
+class SerialWriter {
+public:
+   typedef TransmitScheduler::Clock Clock;
+
+   static const size_t kLanes = static_cast<size_t>(Lane::COUNT);
+   static_assert(kLanes == WriterStats::kLanes, "one latency histogram per lane");
+
+   static const size_t kDefaultControl = 64;
+   static const size_t kDefaultModification = 1024;
+   static const size_t kDefaultTelemetry = 1024;
+   static const int kIdleTimeoutMs = 500;
+   static const uint32_t kScaleUnit = 1000;
+   // frames gathered into one writev()
+   static const size_t kMaxBatch = 16;
+
+   // frames each lane may hold, in Lane order; every frame reserves
+   // FramePool::kDefaultFrameCapacity bytes
+   struct Caps {
+      size_t frames[kLanes] = {kDefaultControl, kDefaultModification, kDefaultTelemetry};
+   };
+
+   SerialWriter() : SerialWriter(Caps()) {}
+
+   explicit SerialWriter(const Caps &caps) :
+      m_wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+      for (size_t i = 0; i < kLanes; ++i) {
+         m_lanes[i].reset(new LaneQueue(std::max<size_t>(caps.frames[i], 1)));
+      }
+      m_scratch.reserve(FramePool::kDefaultFrameCapacity);
+   }
+
+   ~SerialWriter() {
+      stop();
+      std::lock_guard<std::mutex> guard(m_controlLock);
+      for (; !m_control.empty(); m_control.pop_front()) {
+         release(m_control.front());
+      }
+      if (m_wakeFd >= 0) {
+         close(m_wakeFd);
+      }
+   }
+
+   // records every frame as it leaves for the wire; set before start()
+   void capture(CaptureLog *log, uint8_t port) {
+      m_capture = log;
+      m_capturePort = port;
+   }
+
+   void start(int fd, const TransmitScheduler &scheduler) {
+      m_fd = fd;
+      m_scheduler = scheduler;
+      m_running = true;
+      m_thread = std::thread(&SerialWriter::run, this);
+   }
+
+   void stop() {
+      if (m_running.exchange(false)) {
+         wake();
+         if (m_thread.get_id() == std::this_thread::get_id()) {
+            m_thread.detach();
+         } else {
+            m_thread.join();
+         }
+      }
+   }
+
+   // Returns a frame for lane. CONTROL always gets one. MODIFICATION returns
+   // nullptr when the lane is full, in which case the message has to be
+   // dropped. TELEMETRY takes back its oldest queued frame instead.
+   Frame *acquire(Lane lane) {
+      LaneQueue &queue = *m_lanes[static_cast<size_t>(lane)];
+      Frame *frame = queue.pool.acquire();
+      if (!frame) {
+         switch (lane) {
+            case Lane::CONTROL:
+               ++m_controlOverflow;
+               frame = new Frame;
+               frame->created = Clock::now();
+               break;
+            case Lane::TELEMETRY:
+               if (queue.queue.tryPop(frame) || (frame = queue.pool.acquire())) {
+                  ++queue.dropped;
+                  frame->data.clear();
+                  frame->created = Clock::now();
+                  frame->topic = Frame::kNoTopic;
+                  frame->binary = false;
+               }
+               break;
+            default:
+               ++queue.dropped;
+               break;
+         }
+      }
+      if (frame) {
+         frame->lane = lane;
+      }
+      return frame;
+   }
+
+   // Like acquire(), but a full lane is not counted as a drop: the caller
+   // keeps the message and tries again later.
+   Frame *tryAcquire(Lane lane) {
+      Frame *frame = m_lanes[static_cast<size_t>(lane)]->pool.acquire();
+      if (frame) {
+         frame->lane = lane;
+      }
+      return frame;
+   }
+
+   // frames of lane are handed out with at least bytes of capacity from now
+   // on, see FramePool::reserve()
+   void reserve(Lane lane, size_t bytes) {
+      m_lanes[static_cast<size_t>(lane)]->pool.reserve(bytes);
+   }
+
+   // Queues a frame obtained from acquire(); ownership passes to the writer.
+   bool submit(Frame *frame) {
+      if (frame->lane == Lane::CONTROL) {
+         if (frame->topic == Frame::kProtocolTopic || frame->topic == Frame::kTextTopic) {
+            // counted before the writer can see it, so a frame formatted
+            // after the switch always finds it pending
+            ++m_switches;
+         }
+         std::lock_guard<std::mutex> guard(m_controlLock);
+         m_control.push_back(frame);
+         m_controlDepth.store(m_control.size(), std::memory_order_release);
+      } else {
+         LaneQueue &queue = *m_lanes[static_cast<size_t>(frame->lane)];
+         if (!queue.queue.tryPush(std::move(frame))) {
+            queue.pool.release(frame);
+            ++queue.dropped;
+            return false;
+         }
+      }
+      if (m_sleeping.exchange(false)) {
+         wake();
+      }
+      return true;
+   }
+
+   // convenience for messages that are not on a hot path
+   bool enqueue(const std::string &message, Lane lane) {
+      Frame *frame = acquire(lane);
+      if (!frame) {
+         return false;
+      }
+      frame->data.assign(message);
+      return submit(frame);
+   }
+
+   size_t depth(Lane lane) const {
+      if (lane == Lane::CONTROL) {
+         return m_controlDepth.load(std::memory_order_relaxed);
+      }
+      return m_lanes[static_cast<size_t>(lane)]->queue.size();
+   }
+
+   size_t depth() const {
+      size_t total = 0;
+      for (size_t i = 0; i < kLanes; ++i) {
+         total += depth(static_cast<Lane>(i));
+      }
+      return total;
+   }
+
+   // messages refused (MODIFICATION) or overwritten (TELEMETRY) because
+   // their lane was full
+   uint64_t dropped(Lane lane) const {
+      return m_lanes[static_cast<size_t>(lane)]->dropped.load(std::memory_order_relaxed);
+   }
+
+   uint64_t dropped() const {
+      uint64_t total = 0;
+      for (size_t i = 0; i < kLanes; ++i) {
+         total += dropped(static_cast<Lane>(i));
+      }
+      return total;
+   }
+
+   // control frames allocated past the lane's cap
+   uint64_t controlOverflow() const {
+      return m_controlOverflow.load(std::memory_order_relaxed);
+   }
+
+   uint64_t writeErrors() const {
+      return m_writeErrors.load(std::memory_order_relaxed);
+   }
+
+   // recorded by the writer thread only
+   const WriterStats &stats() const {
+      return m_stats;
+   }
+
+   // when the last keepalive ping was written, for timing the MCU's echo
+   Clock::time_point lastPingWritten() const {
+      return Clock::time_point(Clock::duration(m_pingWritten.load(std::memory_order_acquire)));
+   }
+
+   // True while the tty is full and the writer waits for it to drain.
+   bool congested() const {
+      return m_congested.load(std::memory_order_relaxed);
+   }
+
+   // Producers of telemetry that the next sample supersedes anyway skip a
+   // value instead of queueing it behind a stall, and report it here.
+   void skipped() {
+      ++m_congestionDrops;
+   }
+
+   uint64_t congestionDrops() const {
+      return m_congestionDrops.load(std::memory_order_relaxed);
+   }
+
+   // paces at factor (0..1] of the configured rate from the next frame on
+   void setRateScale(double factor) {
+      m_rateScale.store(static_cast<uint32_t>(factor * kScaleUnit), std::memory_order_relaxed);
+   }
+
+private:
+   struct LaneQueue {
+      explicit LaneQueue(size_t frames) : pool(frames), queue(frames) {}
+
+      FramePool pool;
+      MpscQueue<Frame *> queue;
+      std::atomic<uint64_t> dropped{0};
+   };
+
+   // next frame of lane, if any
+   bool pop(Lane lane, Frame *&frame) {
+      bool popped;
+      if (lane == Lane::CONTROL) {
+         if (m_controlDepth.load(std::memory_order_acquire) == 0) {
+            return false;
+         }
+         std::lock_guard<std::mutex> guard(m_controlLock);
+         popped = !m_control.empty();
+         if (popped) {
+            frame = m_control.front();
+            m_control.pop_front();
+            m_controlDepth.store(m_control.size(), std::memory_order_release);
+         }
+      } else {
+         popped = m_lanes[static_cast<size_t>(lane)]->queue.tryPop(frame);
+      }
+      if (popped) {
+         m_stats.highWater.raise(depth() + 1);
+      }
+      return popped;
+   }
+
+   void release(Frame *frame) {
+      FramePool &pool = m_lanes[static_cast<size_t>(frame->lane)]->pool;
+      if (pool.owns(frame)) {
+         pool.release(frame);
+      } else {
+         delete frame;
+      }
+   }
+
+   bool idle() const {
+      for (size_t i = 0; i < kLanes; ++i) {
+         if (depth(static_cast<Lane>(i)) > 0) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   void wake() {
+      uint64_t one = 1;
+      ssize_t n = write(m_wakeFd, &one, sizeof(one));
+      (void) n;
+   }
+
+   // Writes as much of the batch as the tty takes in one writev(), resuming
+   // mid-frame after a short write. returns false if the port is full and
+   // the writer has to wait for POLLOUT.
+   bool flush() {
+      struct iovec iov[kMaxBatch];
+      for (size_t i = 0; i < m_batchSize; ++i) {
+         size_t skip = i == 0 ? m_offset : 0;
+         iov[i].iov_base = const_cast<char *>(m_batch[i]->data.data()) + skip;
+         iov[i].iov_len = m_batch[i]->data.size() - skip;
+      }
+      ssize_t n = serialport_writev(m_fd, iov, static_cast<int>(m_batchSize));
+      if (n < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            m_stats.eagain.add();
+            return false;
+         }
+         if (errno == EINTR) {
+            return true;
+         }
+         // the port is gone or broken, retrying would spin
+         m_writeErrors += m_batchSize;
+         for (size_t i = 0; i < m_batchSize; ++i) {
+            release(m_batch[i]);
+         }
+         m_batchSize = 0;
+         m_offset = 0;
+         return true;
+      }
+      m_stats.writes.add();
+      m_stats.bytes.add(n);
+
+      size_t done = 0;
+      size_t left = static_cast<size_t>(n);
+      while (done < m_batchSize && left >= m_batch[done]->data.size() - m_offset) {
+         left -= m_batch[done]->data.size() - m_offset;
+         m_offset = 0;
+         written(*m_batch[done]);
+         release(m_batch[done]);
+         ++done;
+      }
+      std::copy(m_batch + done, m_batch + m_batchSize, m_batch);
+      m_batchSize -= done;
+      if (m_batchSize == 0) {
+         return true;
+      }
+      m_offset += left;
+      m_stats.shortWrites.add();
+      return false;
+   }
+
+   // a frame has completely left for the wire
+   void written(const Frame &frame) {
+      m_stats.frames.add();
+      if (frame.topic < WriterStats::kMaxTopics) {
+         m_stats.topics[frame.topic].add();
+      } else if (frame.topic == Frame::kPingTopic) {
+         m_pingWritten.store(Clock::now().time_since_epoch().count(), std::memory_order_release);
+      }
+      Clock::time_point now = Clock::now();
+      m_stats.ddsToSerial.record(frame.created, now);
+      m_stats.laneLatency[static_cast<size_t>(frame.lane)].record(frame.created, now);
+      if (m_capture) {
+         m_capture->serial(CaptureKind::SERIAL_OUT, m_capturePort, frame.data);
+      }
+   }
+
+   // Sleeps until the tty has room again. Producers see the port as
+   // congested meanwhile.
+   void waitWritable() {
+      Clock::time_point start = Clock::now();
+      m_congested.store(true, std::memory_order_relaxed);
+      m_stats.stalls.add();
+
+      struct pollfd pfds[2];
+      pfds[0].fd = m_fd;
+      pfds[0].events = POLLOUT;
+      pfds[0].revents = 0;
+      pfds[1].fd = m_wakeFd;
+      pfds[1].events = POLLIN;
+      pfds[1].revents = 0;
+      if (poll(pfds, 2, kIdleTimeoutMs) > 0 && (pfds[1].revents & POLLIN)) {
+         uint64_t count;
+         ssize_t n = read(m_wakeFd, &count, sizeof(count));
+         (void) n;
+      }
+
+      m_congested.store(false, std::memory_order_relaxed);
+      m_stats.stalled.record(start, Clock::now());
+   }
+
+   // frames queued on the lane before the switch drain at the old rate
+   void switchBaud(const Frame &frame) {
+      int baud = atoi(frame.data.c_str());
+      tcdrain(m_fd);
+      if (serialport_set_baud(m_fd, baud) < 0) {
+         ++m_writeErrors;
+         return;
+      }
+      m_scheduler.setBaud(baud);
+   }
+
+   void run() {
+      Realtime::enter(Realtime::Role::IO);
+      const Clock::duration deadline = Realtime::options().deadline;
+
+      while (m_running) {
+         uint32_t scale = m_rateScale.load(std::memory_order_relaxed);
+         if (scale != m_appliedScale) {
+            m_scheduler.scale(static_cast<double>(scale) / kScaleUnit);
+            m_appliedScale = scale;
+         }
+
+         // Gather every frame the scheduler lets go now into one batch,
+         // highest lane first. A frame the scheduler holds back stops the
+         // gathering, so a lower lane never overtakes it.
+         Clock::time_point now = Clock::now();
+         Frame *held = nullptr;
+         bool flushFirst = false;
+         // a binary frame overtook the switch, which is queued on CONTROL
+         bool awaitSwitch = false;
+         for (size_t i = 0; i < kLanes && !held && !flushFirst && !awaitSwitch; ++i) {
+            Frame *&frame = m_pending[i];
+            while (m_batchSize < kMaxBatch) {
+               if (!frame && !pop(static_cast<Lane>(i), frame)) {
+                  break;
+               }
+               if (frame->topic == Frame::kBaudTopic) {
+                  if (m_batchSize > 0) {
+                     flushFirst = true;
+                     break;
+                  }
+                  switchBaud(*frame);
+                  release(frame);
+                  frame = nullptr;
+                  continue;
+               }
+               if (frame->topic == Frame::kTextTopic) {
+                  m_binary = false;
+                  --m_switches;
+                  release(frame);
+                  frame = nullptr;
+                  continue;
+               }
+               if (frame->binary != m_binary) {
+                  if (m_switches.load() > 0) {
+                     awaitSwitch = true;
+                     break;
+                  }
+                  if (frame->binary) {
+                     ++m_lanes[i]->dropped;
+                     release(frame);
+                     frame = nullptr;
+                     continue;
+                  }
+                  BinaryProtocol::wrapText(*frame, m_scratch);
+                  frame->binary = true;
+               }
+               if (!m_scheduler.admit(frame->data.size(), now)) {
+                  held = frame;
+                  break;
+               }
+               m_batch[m_batchSize++] = frame;
+               frame = nullptr;
+               if (m_batch[m_batchSize - 1]->topic == Frame::kProtocolTopic) {
+                  m_binary = true;
+                  --m_switches;
+               }
+            }
+         }
+
+         if (m_batchSize > 0) {
+            if (!flush()) {
+               waitWritable();
+            }
+            continue;
+         }
+
+         int timeoutMs = kIdleTimeoutMs;
+         Clock::time_point due;
+         if (held) {
+            timeoutMs = m_scheduler.delayMs(held->data.size(), now);
+            due = now + std::chrono::milliseconds(timeoutMs);
+         } else {
+            // announce that we are going to sleep, then make sure nothing
+            // slipped in before the producers could see it; a frame waiting
+            // for a switch only needs the switch, which comes on CONTROL
+            m_sleeping = true;
+            if (awaitSwitch ? m_controlDepth.load() > 0 : !idle()) {
+               m_sleeping = false;
+               continue;
+            }
+         }
+
+         struct pollfd pfd;
+         pfd.fd = m_wakeFd;
+         pfd.events = POLLIN;
+         pfd.revents = 0;
+         int ready = poll(&pfd, 1, timeoutMs);
+         if (ready > 0) {
+            uint64_t count;
+            ssize_t n = read(m_wakeFd, &count, sizeof(count));
+            (void) n;
+         } else if (ready == 0 && held && Clock::now() - due > deadline) {
+            m_stats.missedDeadlines.add();
+         } else if (ready == 0 && awaitSwitch) {
+            LOG_WARNING << "Serial writer: a frame is still waiting for a wire protocol switch";
+         }
+         m_sleeping = false;
+      }
+
+      for (size_t i = 0; i < m_batchSize; ++i) {
+         release(m_batch[i]);
+      }
+      m_batchSize = 0;
+      for (Frame *&frame : m_pending) {
+         if (frame) {
+            release(frame);
+            frame = nullptr;
+         }
+      }
+   }
+
+   std::unique_ptr<LaneQueue> m_lanes[kLanes];
+   std::mutex m_controlLock;
+   FrameRing m_control{kDefaultControl};
+   std::atomic<size_t> m_controlDepth{0};
+   std::atomic<uint64_t> m_controlOverflow{0};
+   // popped from each lane but not yet admitted by the scheduler
+   Frame *m_pending[kLanes] = {};
+   TransmitScheduler m_scheduler;
+   int m_fd = -1;
+   int m_wakeFd;
+   std::thread m_thread;
+   std::atomic<bool> m_running{false};
+   std::atomic<bool> m_sleeping{false};
+   std::atomic<uint64_t> m_writeErrors{0};
+   WriterStats m_stats;
+   std::atomic<Clock::rep> m_pingWritten{0};
+   std::atomic<uint32_t> m_rateScale{kScaleUnit};
+   uint32_t m_appliedScale = kScaleUnit;
+   std::atomic<bool> m_congested{false};
+   std::atomic<uint64_t> m_congestionDrops{0};
+   Frame *m_batch[kMaxBatch];
+   size_t m_batchSize = 0;
+   // bytes of m_batch[0] already written
+   size_t m_offset = 0;
+   CaptureLog *m_capture = nullptr;
+   uint8_t m_capturePort = 0;
+   // the MCU has been told to expect binary packets
+   bool m_binary = false;
+   // protocol switches submitted but not yet reached by the writer
+   std::atomic<int> m_switches{0};
+   // trades buffers with the text frames it wraps, so it starts out as large
+   // as a pooled frame
+   std::string m_scratch;
+};
+
+#endif //AMM_MODULES_SERIAL_WRITER_H
@@ -0,0 +1,127 @@
+#ifndef AMM_MODULES_TRANSMIT_SCHEDULER_H
+#define AMM_MODULES_TRANSMIT_SCHEDULER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+// Token bucket that paces outbound frames to what the wire and the MCU can
+// actually absorb.
+//
+// The refill rate is the UART's byte rate (8N1, so ten bits per byte) capped by
+// an optional MCU receive budget in bytes/s. The bucket depth is the MCU's
+// receive buffer, so a burst never overruns it. An optional gap is enforced
+// between the end of one frame and the start of the next for MCUs that need
+// time to process each line.
+class TransmitScheduler {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   static const int kBitsPerByte = 10;
+   static const size_t kDefaultBurst = 256;
+   static constexpr double kMinScale = 0.1;
+
+   explicit TransmitScheduler(int baud = 115200, int rxBudget = 0,
+                              std::chrono::microseconds frameGap = std::chrono::microseconds(0),
+                              size_t burst = kDefaultBurst) {
+      configure(baud, rxBudget, frameGap, burst);
+   }
+
+   // rxBudget is in bytes/s, 0 means the wire rate is the only limit
+   void configure(int baud, int rxBudget, std::chrono::microseconds frameGap,
+                  size_t burst = kDefaultBurst) {
+      m_rxBudget = rxBudget;
+      setBaud(baud);
+      m_burst = static_cast<double>(std::max<size_t>(burst, 1));
+      m_tokens = m_burst;
+      m_gap = frameGap;
+      m_last = m_nextFrame = Clock::now();
+   }
+
+   // Takes the tokens for a frame of len bytes if it may go out now.
+   // Frames larger than the bucket are admitted once it is full and leave it in
+   // debt, which delays the frames behind them accordingly.
+   bool admit(size_t len, Clock::time_point now) {
+      refill(now);
+      if (now < m_nextFrame || m_tokens < need(len)) {
+         return false;
+      }
+      m_tokens -= static_cast<double>(len);
+      if (m_gap.count() > 0) {
+         // the gap starts once this frame has left the wire
+         m_nextFrame = now + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(len / m_rate)) + m_gap;
+      }
+      return true;
+   }
+
+   // How long until a frame of len bytes would be admitted.
+   Clock::duration delay(size_t len, Clock::time_point now) {
+      refill(now);
+      Clock::duration wait = Clock::duration::zero();
+      double missing = need(len) - m_tokens;
+      if (missing > 0) {
+         wait = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(missing / m_rate));
+      }
+      if (m_nextFrame > now) {
+         wait = std::max(wait, m_nextFrame - now);
+      }
+      return wait;
+   }
+
+   // delay() rounded up to whole milliseconds, for use as a poll() timeout
+   int delayMs(size_t len, Clock::time_point now) {
+      Clock::duration d = delay(len, now);
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(d);
+      if (ms < d) {
+         ++ms;
+      }
+      return static_cast<int>(ms.count());
+   }
+
+   double rate() const {
+      return m_rate;
+   }
+
+   // the line speed changed; the receive budget and any scale still apply
+   void setBaud(int baud) {
+      m_configuredRate = static_cast<double>(baud) / kBitsPerByte;
+      if (m_rxBudget > 0) {
+         m_configuredRate = std::min(m_configuredRate, static_cast<double>(m_rxBudget));
+      }
+      m_rate = m_configuredRate * m_scale;
+   }
+
+   // Runs at factor (0..1] of the configured rate, for when the MCU is
+   // measured to fall behind.
+   void scale(double factor) {
+      m_scale = std::min(1.0, std::max(factor, kMinScale));
+      m_rate = m_configuredRate * m_scale;
+   }
+
+private:
+   double need(size_t len) const {
+      return std::min(static_cast<double>(len), m_burst);
+   }
+
+   void refill(Clock::time_point now) {
+      if (now > m_last) {
+         double elapsed = std::chrono::duration<double>(now - m_last).count();
+         m_tokens = std::min(m_burst, m_tokens + elapsed * m_rate);
+         m_last = now;
+      }
+   }
+
+   double m_rate;
+   double m_configuredRate;
+   double m_scale = 1.0;
+   int m_rxBudget = 0;
+   double m_burst;
+   double m_tokens;
+   std::chrono::microseconds m_gap;
+   Clock::time_point m_last;
+   Clock::time_point m_nextFrame;
+};
+
+#endif //AMM_MODULES_TRANSMIT_SCHEDULER_H
@@ -1,17 +1,25 @@
-#include <boost/algorithm/string.hpp>
-#include <boost/foreach.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
 
+#include <pthread.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
 #include <vector>
-#include <queue>
 #include <stack>
 #include <chrono>
 #include <thread>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <variant>
 
 #include "amm_std.h"
 
@@ -19,6 +27,19 @@ extern "C" {
 #include "Serial/arduino-serial-lib.h"
 }
 
+#include "Bridge/routing-table.h"
+#include "Bridge/capture.h"
+#include "Bridge/message-format.h"
+#include "Bridge/conflation.h"
+#include "Bridge/config-cache.h"
+#include "Bridge/metrics.h"
+#include "Bridge/prefix-table.h"
+#include "Bridge/publisher.h"
+#include "Bridge/session.h"
+#include "Bridge/topic-message.h"
+#include "Bridge/reactor.h"
+#include "Bridge/realtime.h"
+
 #include "tinyxml2.h"
 #include <gpiod.h>
 
@@ -32,221 +53,267 @@ using namespace std::chrono;
 using namespace tinyxml2;
 
 bool first_message = true;
-bool closed = false;
-bool initializing = true;
-
-std::string globalInboundBuffer;
-std::string requestPrefix = "[REQUEST]";
-std::string reportPrefix = "[REPORT]";
-std::string actionPrefix = "[AMM_Command]";
-std::string genericTopicPrefix = "[";
-std::string xmlPrefix = "<?xml";
-
-const string capabilityPrefix = "CAPABILITY=";
-const string settingsPrefix = "SETTINGS=";
-const string statusPrefix = "STATUS=";
-const string configPrefix = "CONFIG=";
-const string modulePrefix = "MODULE_NAME=";
-const string registerPrefix = "REGISTER=";
-const string keepHistoryPrefix = "KEEP_HISTORY=";
-const string keepAlivePrefix = "[KEEPALIVE]";
-const string loadScenarioPrefix = "LOAD_SCENARIO:";
-const string haltingString = "HALTING_ERROR";
-const string sysPrefix = "[SYS]";
-const string actPrefix = "[ACT]";
-const string loadPrefix = "LOAD_STATE:";
-std::string client_module_name;
+std::atomic<bool> closed{false};
 
-std::vector<std::string> subscribedTopics;
-std::vector<std::string> publishedTopics;
-std::map<std::string, std::string> subMaps;
-std::map<std::string, std::map<std::string, std::string>> equipmentSettings;
+const string sysPrefix = "[SYS]";
+const string configPrefix = "CONFIG=";
 
-std::queue<std::string> transmitQ;
+// one session per serial port; all of them share the DDS participant and fan
+// out from the shared routing index
+std::vector<std::unique_ptr<Session>> sessions;
+RoutingIndex routingIndex;
 
-int fd = -1;
-int rc;
+// With --capture, serial traffic and every DDS sample the listener sees are
+// recorded here; --replay plays such a capture back instead.
+CaptureLog captureLog;
+CaptureReplay replay;
 
 // set up GPIO enable line
 const char *chipname = "gpiochip0";
-struct gpiod_chip *chip;
-struct gpiod_line *lineMCUEnable;
-
-void sendConfigInfo(std::string scene, std::string module) {
-   std::ostringstream static_filename;
-   static_filename << "static/module_configuration_static/" << scene << "_" << module << ".txt";
-   LOG_DEBUG << "Loading config from filename: " << static_filename.str();
-   std::ifstream ifs(static_filename.str());
-   std::string configContent((std::istreambuf_iterator<char>(ifs)),
-                             (std::istreambuf_iterator<char>()));
-   ifs.close();
-   if (configContent.empty()) {
+struct gpiod_chip *chip = nullptr;
+struct gpiod_line *lineMCUEnable = nullptr;
+
+// Rate-limited values leave the conflator either straight from the listener
+// or from its flush thread.
+Conflator conflator([](Session *session, const WireTopic &topic, double value) {
+   session->transmitValue(topic, value);
+}, [](Session *session, const WireTopic &topic, const WaveformBlock &block) {
+   session->transmitWaveform(topic, block);
+});
+
+// Static configs are indexed and mapped once at startup.
+ConfigCache configCache;
+
+void sendConfigInfo(Session &session, const std::string &scene, const std::string &module) {
+   LOG_DEBUG << "Loading config " << scene << "_" << module;
+   std::shared_ptr<const ConfigFile> config = configCache.find(scene, module);
+   if (!config) {
       LOG_ERROR << "Configuration empty.";
       return;
    }
-   std::vector<std::string> v = Utility::explode("\n", configContent);
-   for (int i = 0; i < v.size(); i++) {
-      std::string rsp = v[i] + "\n";
-      transmitQ.push(rsp);
-   }
-};
+   session.sendConfig(config);
+}
 
 class AMMListener : public ListenerInterface {
 public:
     void onNewPhysiologyWaveform(AMM::PhysiologyWaveform &n, SampleInfo_t *info) {
-       std::string hfname = "HF_" + n.name();
-       if (std::find(subscribedTopics.begin(), subscribedTopics.end(), hfname) != subscribedTopics.end()) {
-          std::ostringstream messageOut;
-          map<string, string>::iterator i = subMaps.find(hfname);
-          if (i == subMaps.end()) {
-             messageOut << "[AMM_Node_Data]" << n.name() << "=" << n.value() << std::endl;
-          } else {
-             messageOut << "[" << i->first << "]" << n.value() << std::endl;
-          }
-
-          rc = serialport_write(fd, messageOut.str().c_str());
-          if (rc == -1) {
-             LOG_ERROR << " Error writing to serial port";
+       if (captureLog.active()) {
+          captureLog.number(CaptureKind::PHYSIOLOGY_WAVEFORM, n.name(), n.value());
+       }
+       // Samples are decimated and batched per subscription; a full block
+       // goes out right away, a short one from the conflator once it expires
+       std::shared_ptr<const RoutingIndex::Snapshot> routes = routingIndex.load();
+       const RoutingIndex::Targets *targets = routes->findWaveform(n.name());
+       if (targets) {
+          thread_local WaveformBlock block;
+          WaveformSlot::Clock::time_point now = WaveformSlot::Clock::now();
+          for (const RoutingIndex::Target &target : *targets) {
+             switch (target.route->waveform->offer(n.value(), now, block)) {
+                case WaveformSlot::Offer::FULL:
+                   target.session->transmitWaveform(*target.route, block);
+                   break;
+                case WaveformSlot::Offer::STARTED:
+                   conflator.expire(target.route->waveform, now + target.route->waveform->maxAge());
+                   break;
+                default:
+                   break;
+             }
           }
        }
     }
 
     void onNewPhysiologyValue(AMM::PhysiologyValue &n, SampleInfo_t *info) {
+       if (captureLog.active()) {
+          captureLog.number(CaptureKind::PHYSIOLOGY_VALUE, n.name(), n.value());
+       }
        // Publish values that are supposed to go out on every change
-       if (std::find(subscribedTopics.begin(), subscribedTopics.end(), n.name()) != subscribedTopics.end()) {
-          std::ostringstream messageOut;
-          map<string, string>::iterator i = subMaps.find(n.name());
-          if (i == subMaps.end()) {
-             messageOut << "[AMM_Node_Data]" << n.name() << "=" << n.value() << std::endl;
-          } else {
-             messageOut << "[" << i->first << "]" << n.value() << std::endl;
-          }
-
-          rc = serialport_write(fd, messageOut.str().c_str());
-          if (rc == -1) {
-             LOG_ERROR << " Error writing to serial port";
+       std::shared_ptr<const RoutingIndex::Snapshot> routes = routingIndex.load();
+       const RoutingIndex::Targets *targets = routes->find(n.name());
+       if (targets) {
+          for (const RoutingIndex::Target &target : *targets) {
+             if (target.route->conflation) {
+                conflator.offer(target.route->conflation, n.value());
+             } else {
+                target.session->transmitValue(*target.route, n.value());
+             }
           }
        }
     }
 
     void onNewPhysiologyModification(AMM::PhysiologyModification &pm, SampleInfo_t *info) {
-       // Publish values that are supposed to go out on every change
-       std::ostringstream messageOut;
-       messageOut << "[AMM_Physiology_Modification]"
-                  << "type=" << pm.type() << ";"
-                  //<< "location=" << pm.location().description() << ";"
-                  //<< "learner_id=" << pm.practitioner() << ";"
-                  << "payload=" << pm.data()
-                  << std::endl;
-       std::string stringOut = messageOut.str();
-       LOG_DEBUG << "Physiology modification received from AMM: " << stringOut;
-
-       if (std::find(subscribedTopics.begin(), subscribedTopics.end(), pm.type()) != subscribedTopics.end() ||
-           std::find(subscribedTopics.begin(), subscribedTopics.end(), "AMM_Physiology_Modification") !=
-           subscribedTopics.end()
-          ) {
-          transmitQ.push(messageOut.str());
+       if (captureLog.active()) {
+          captureLog.text(CaptureKind::PHYSIOLOGY_MODIFICATION, pm.type(), pm.data());
        }
+       // Publish values that are supposed to go out on every change
+       routingIndex.load()->forEachPhysiologyModification(pm.type(), [&pm](Session &session) {
+          Frame *frame = session.acquireFrame(Lane::MODIFICATION);
+          if (frame) {
+             MessageFormat::modification(*frame, MessageFormat::kPhysiologyModificationPrefix,
+                                         pm.type(), pm.data());
+             LOG_DEBUG << "Physiology modification received from AMM: " << frame->data;
+             session.transmit(frame);
+          }
+       });
     }
 
     void onNewRenderModification(AMM::RenderModification &rendMod, SampleInfo_t *info) {
-       // Publish values that are supposed to go out on every change
-       std::ostringstream messageOut;
-       messageOut << "[AMM_Render_Modification]"
-                  << "type=" << rendMod.type() << ";"
-                  //<< "location=" << rm.location().description() << ";"
-                  //<< "learner_id=" << rm.practitioner() << ";"
-                  << "payload=" << rendMod.data()
-                  << std::endl;
-       std::string stringOut = messageOut.str();
-
-       LOG_DEBUG << "Render modification received from AMM: " << stringOut;
-
-       if (std::find(subscribedTopics.begin(), subscribedTopics.end(), rendMod.type()) != subscribedTopics.end() ||
-           std::find(subscribedTopics.begin(), subscribedTopics.end(), "AMM_Render_Modification") !=
-           subscribedTopics.end()
-          ) {
-          transmitQ.push(messageOut.str());
+       if (captureLog.active()) {
+          captureLog.text(CaptureKind::RENDER_MODIFICATION, rendMod.type(), rendMod.data());
        }
-
+       // Publish values that are supposed to go out on every change
+       routingIndex.load()->forEachRenderModification(rendMod.type(), [&rendMod](Session &session) {
+          Frame *frame = session.acquireFrame(Lane::MODIFICATION);
+          if (frame) {
+             MessageFormat::modification(*frame, MessageFormat::kRenderModificationPrefix,
+                                         rendMod.type(), rendMod.data());
+             LOG_DEBUG << "Render modification received from AMM: " << frame->data;
+             session.transmit(frame);
+          }
+       });
     }
+
     void onNewSimulationControl(AMM::SimulationControl &simControl, SampleInfo_t *info) {
+       if (captureLog.active()) {
+          captureLog.control(static_cast<int32_t>(simControl.type()));
+       }
+       const char *command = nullptr;
 
        switch (simControl.type()) {
           case AMM::ControlType::RUN: {
              LOG_INFO << "SimControl Message recieved; Run sim.";
-             std::ostringstream cmdMessage;
-             cmdMessage << "[AMM_Command]START_SIM\n";
-             transmitQ.push(cmdMessage.str());
+             command = "START_SIM";
              break;
           }
 
           case AMM::ControlType::HALT: {
              LOG_INFO << "SimControl recieved; Halt sim";
-             std::ostringstream cmdMessage;
-             cmdMessage << "[AMM_Command]PAUSE_SIM\n";
-             transmitQ.push(cmdMessage.str());
+             command = "PAUSE_SIM";
              break;
           }
 
           case AMM::ControlType::RESET: {
              LOG_INFO << "SimControl recieved; Reset sim";
-             std::ostringstream cmdMessage;
-             cmdMessage << "[AMM_Command]RESET_SIM\n";
-             transmitQ.push(cmdMessage.str());
+             command = "RESET_SIM";
              break;
           }
 
           case AMM::ControlType::SAVE: {
              LOG_INFO << "SimControl recieved; Save sim";
-             std::ostringstream cmdMessage;
-             cmdMessage << "[AMM_Command]SAVE_STATE\n";
-             transmitQ.push(cmdMessage.str());
+             command = "SAVE_STATE";
              break;
           }
        }
+
+       if (command) {
+          // every MCU follows the simulation state
+          for (auto &session : sessions) {
+             Frame *frame = session->acquireFrame(Lane::CONTROL);
+             if (frame) {
+                MessageFormat::command(*frame, command, strlen(command));
+                session->transmit(frame);
+             }
+          }
+       }
     }
 
     void onNewCommand(AMM::Command &c, eprosima::fastrtps::SampleInfo_t *info) {
+       if (captureLog.active()) {
+          captureLog.text(CaptureKind::COMMAND, c.message());
+       }
        LOG_DEBUG << "Command received from AMM: " << c.message();
-       if (!c.message().compare(0, sysPrefix.size(), sysPrefix)) {
-          std::string value = c.message().substr(sysPrefix.size());
+       const std::string &message = c.message();
+       size_t start = 0;
+       size_t len = message.size();
+
+       if (!message.compare(0, sysPrefix.size(), sysPrefix)) {
+          start = sysPrefix.size();
 
           // strip manikin ID if present
-           value  = value.substr(0, value.find(";mid="));
+          size_t mid = message.find(";mid=", start);
+          len = (mid == std::string::npos ? message.size() : mid) - start;
 
           // for configuration command send config file content
-          if (!value.compare(0, configPrefix.size(), configPrefix)) {
-             std::string model = value.substr(configPrefix.size());
+          if (!message.compare(start, configPrefix.size(), configPrefix)) {
+             std::string model = message.substr(start + configPrefix.size(), len - configPrefix.size());
              std::transform(model.begin(), model.end(), model.begin(), ::toupper);
 
-             sendConfigInfo(model, client_module_name);
-          } else {
+             for (auto &session : sessions) {
+                sendConfigInfo(*session, model, session->clientModuleName);
+             }
+             return;
+          }
+       }
 
-            // Send it on through the bridge
-            std::ostringstream cmdMessage;
-            cmdMessage << "[AMM_Command]" << value << "\n";
-	    LOG_TRACE << " Sending to MCU: " << cmdMessage.str();
-            transmitQ.push(cmdMessage.str());
+       // Send it on through the bridge
+       for (auto &session : sessions) {
+          Frame *frame = session->acquireFrame(Lane::CONTROL);
+          if (frame) {
+             MessageFormat::command(*frame, message.data() + start, len);
+             LOG_TRACE << " Sending to MCU on " << session->port() << ": " << frame->data;
+             session->transmit(frame);
           }
-       } else {
-          std::ostringstream cmdMessage;
-          cmdMessage << "[AMM_Command]" << c.message() << "\n";
-	  LOG_TRACE << " Sending to MCU: " << cmdMessage.str();
-          transmitQ.push(cmdMessage.str());
        }
     }
 };
 
+// SIGINT and SIGTERM are read from a signalfd by the reactor, so they must be
+// blocked in every thread. This runs during static initialization, before the
+// DDS manager below starts the threads that inherit the mask.
+sigset_t blockShutdownSignals() {
+   sigset_t mask;
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGINT);
+   sigaddset(&mask, SIGTERM);
+   pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+   return mask;
+}
+
+const sigset_t shutdownSignals = blockShutdownSignals();
+
 const std::string moduleName = "AMM_Serial_Bridge";
 const std::string configFile = "config/serial_bridge_amm.xml";
 AMM::DDSManager<AMMListener> *mgr = new AMM::DDSManager<AMMListener>(configFile);
 AMM::UUID m_uuid;
 
-void PublishSettings(std::string const &equipmentType) {
+// Everything the MCUs send goes out on DDS from the publish worker, so the
+// reactor never waits on FastRTPS.
+Publisher publisher([](PublishJob::Sample &sample) {
+   std::visit([](auto &s) {
+      typedef std::decay_t<decltype(s)> T;
+      if constexpr (std::is_same_v<T, AMM::Command>) {
+         mgr->WriteCommand(s);
+      } else if constexpr (std::is_same_v<T, AMM::RenderModification>) {
+         mgr->WriteRenderModification(s);
+      } else if constexpr (std::is_same_v<T, AMM::PhysiologyModification>) {
+         mgr->WritePhysiologyModification(s);
+      } else if constexpr (std::is_same_v<T, AMM::Assessment>) {
+         mgr->WriteAssessment(s);
+      } else if constexpr (std::is_same_v<T, AMM::Status>) {
+         mgr->WriteStatus(s);
+      } else if constexpr (std::is_same_v<T, AMM::InstrumentData>) {
+         mgr->WriteInstrumentData(s);
+      } else if constexpr (std::is_same_v<T, AMM::OperationalDescription>) {
+         mgr->WriteOperationalDescription(s);
+      }
+   }, sample);
+});
+
+// queues a parsed sample from session's MCU for the publish worker, false if
+// it was dropped
+template<typename T>
+bool publish(Session &session, T &&sample) {
+   if (!publisher.publish(PublishJob{&session, session.lineReceived(), std::forward<T>(sample)})) {
+      session.publishDropped();
+      LOG_WARNING << "DDS publish queue full, dropping message from " << session.port();
+      return false;
+   }
+   return true;
+}
+
+void PublishSettings(Session &session, std::string const &equipmentType) {
    std::ostringstream payload;
    LOG_INFO << "Publishing equipment " << equipmentType << " settings";
-   for (auto &inner_map_pair : equipmentSettings[equipmentType]) {
+   for (auto &inner_map_pair : session.equipmentSettings[equipmentType]) {
       payload << inner_map_pair.first << "=" << inner_map_pair.second
               << std::endl;
       LOG_DEBUG << "\t" << inner_map_pair.first << ": " << inner_map_pair.second;
@@ -255,287 +322,782 @@ void PublishSettings(std::string const &equipmentType) {
    AMM::InstrumentData i;
    i.instrument(equipmentType);
    i.payload(payload.str());
-   mgr->WriteInstrumentData(i);
+   publish(session, std::move(i));
 }
 
-void readHandler() {
-   std::vector<std::string> v = Utility::explode("\n", globalInboundBuffer);
-   globalInboundBuffer.clear();
-   for (int i = 0; i < v.size(); i++) {
-      std::string rsp = v[i];
-      if (!rsp.compare(0, reportPrefix.size(), reportPrefix)) {
-         std::string value = rsp.substr(reportPrefix.size());
-         LOG_DEBUG << "Received report via serial: " << value;
-      } else if (!rsp.compare(0, actionPrefix.size(), actionPrefix)) {
-         std::string value = rsp.substr(actionPrefix.size());
-         LOG_INFO << "Received command via serial, publishing to AMM: " << value;
-         AMM::Command cmdInstance;
-         boost::trim_right(value);
-         cmdInstance.message(value);
-         mgr->WriteCommand(cmdInstance);
-      } else if (!rsp.compare(0, xmlPrefix.size(), xmlPrefix)) {
-         std::string value = rsp;
-         LOG_INFO << "Received XML via serial";
-         LOG_DEBUG << "\tXML: " << value;
-         tinyxml2::XMLDocument doc(false);
-         doc.Parse(value.c_str());
-         tinyxml2::XMLNode *root = doc.FirstChildElement("AMMModuleConfiguration");
-
-         if (root) {
-            tinyxml2::XMLNode *mod = root->FirstChildElement("module");
-            tinyxml2::XMLElement *module = mod->ToElement();
-
-            if (initializing) {
-               LOG_INFO << "Module is initializing, so we'll publish the Operational Description.";
-
-               std::string module_name = module->Attribute("name");
-               std::string manufacturer = module->Attribute("manufacturer");
-               std::string model = module->Attribute("model");
-               std::string serial_number = module->Attribute("serial_number");
-               std::string module_version = module->Attribute("module_version");
-
-               AMM::OperationalDescription od;
-               od.name(module_name);
-               od.model(model);
-               od.manufacturer(manufacturer);
-               od.serial_number(serial_number);
-               od.module_id(m_uuid);
-               od.module_version(module_version);
-               // const std::string capabilities = AMM::Utility::read_file_to_string("config/tcp_bridge_capabilities.xml");
-               // od.capabilities_schema(capabilities);
-               mgr->WriteOperationalDescription(od);
-
-               // load static config data for serial bridge client module on startup
-               std::transform(model.begin(), model.end(), model.begin(), ::toupper);
-               std::transform(module_name.begin(), module_name.end(), module_name.begin(), ::toupper);
-               client_module_name = module_name;
-               sendConfigInfo(model, module_name);
-               initializing = false;
-            }
+// Handlers for each kind of line from the MCU. rsp is the whole line and body
+// what follows its prefix; both point into the receive buffer, so nothing is
+// copied unless a handler needs to keep the data.
+
+void handleReport(Session &session, std::string_view rsp, std::string_view body) {
+   LOG_DEBUG << "Received report via serial: " << std::string(body);
+}
+
+void handleCommand(Session &session, std::string_view rsp, std::string_view body) {
+   std::string_view value = body;
+   while (!value.empty() && isspace(static_cast<unsigned char>(value.back()))) {
+      value.remove_suffix(1);
+   }
+   LOG_INFO << "Received command via serial, publishing to AMM: " << std::string(value);
+   AMM::Command cmdInstance;
+   cmdInstance.message(std::string(value));
+   publish(session, std::move(cmdInstance));
+}
 
+// [CONFIG_ACK]id=<transfer>;count=<lines consumed>
+void handleConfigAck(Session &session, std::string_view rsp, std::string_view body) {
+   unsigned int id = 0;
+   size_t count = 0;
+   std::string ack(body);
+   if (sscanf(ack.c_str(), "id=%u;count=%zu", &id, &count) != 2) {
+      session.parseError(LineType::CONTROL);
+      LOG_WARNING << "Malformed config ACK: " << ack;
+      return;
+   }
+   session.configAcknowledged(id, count);
+}
 
-            tinyxml2::XMLNode *caps = mod->FirstChildElement("capabilities");
+// FNV-1a, to recognise a document the MCU has sent before
+uint64_t contentHash(std::string_view data) {
+   uint64_t hash = 14695981039346656037ull;
+   for (char c : data) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+   }
+   return hash;
+}
 
-            if (caps) {
-               // Clear the subs and pubs before we re-gather them
+// Publishes the state of the serial link to an MCU as the status of its
+// SERIAL_LINK capability, when it changed.
+void publishLinkStatus(Session &session, std::chrono::steady_clock::time_point now) {
+   AMM::Status s;
+   s.module_id(m_uuid);
+   s.module_name(session.clientModuleName.empty() ? session.port() : session.clientModuleName);
+   s.capability("SERIAL_LINK");
+   if (session.link.up()) {
+      s.value(AMM::StatusValue::OPERATIONAL);
+   } else {
+      s.value(AMM::StatusValue::INOPERATIVE);
+      s.message("No keepalive from " + session.port() + " for " +
+                std::to_string(session.link.silence(now).count()) + " ms");
+   }
+   session.statusCache.update(s, now, [&session](const AMM::Status &status) {
+      LOG_WARNING << "Serial link to " << session.port() << (session.link.up() ? " is back up" : " is down");
+      if (!publisher.publish(PublishJob{nullptr, {}, status})) {
+         session.publishDropped();
+         return false;
+      }
+      return true;
+   });
+}
 
-               bool firstSub = true;
-               bool firstPub = true;
+// [KEEPALIVE]seq=<n>;t=<us> echoed by the MCU
+void handleKeepalive(Session &session, std::string_view rsp, std::string_view body) {
+   unsigned int seq = 0;
+   unsigned long long stamp = 0;
+   std::string echo(body);
+   if (sscanf(echo.c_str(), "seq=%u;t=%llu", &seq, &stamp) != 2) {
+      session.parseError(LineType::CONTROL);
+      LOG_WARNING << "Malformed keepalive: " << echo;
+      return;
+   }
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+   if (session.link.echo(seq, session.lastPingWritten(), now)) {
+      publishLinkStatus(session, now);
+   }
+   session.setRateScale(session.link.rateScale());
+}
 
-               for (tinyxml2::XMLNode *node = caps->FirstChildElement(
-                  "capability"); node; node = node->NextSibling()) {
-                  tinyxml2::XMLElement *cap = node->ToElement();
-                  std::string capabilityName = cap->Attribute("name");
+// fastest rate to negotiate up to, 0 to stay at the -b rate
+int negotiateBaud = 0;
 
-                  tinyxml2::XMLElement *starting_settings = cap->FirstChildElement(
-                     "starting_settings");
-                  if (starting_settings) {
-                     LOG_DEBUG << "Received starting settings";
-                     for (tinyxml2::XMLNode *settingNode = starting_settings->FirstChildElement(
-                        "setting"); settingNode; settingNode = settingNode->NextSibling()) {
-                        tinyxml2::XMLElement *setting = settingNode->ToElement();
-                        std::string settingName = setting->Attribute("name");
-                        std::string settingValue = setting->Attribute("value");
-                        LOG_DEBUG << "[" << settingName << "] = " << settingValue;
-                     }
-                  }
+void applyBaudStep(Session &session, const BaudNegotiator::Step &step) {
+   if (step.baud) {
+      LOG_INFO << "Switching " << session.port() << " to " << step.baud << " baud";
+      session.changeBaud(step.baud);
+   }
+   if (!step.line.empty()) {
+      session.transmit(step.line, Lane::CONTROL);
+   }
+}
 
-                  tinyxml2::XMLElement *configEl =
-                     cap->FirstChildElement("configuration");
-                  if (configEl) {
-                     for (tinyxml2::XMLNode *settingNode =
-                        configEl->FirstChildElement("setting");
-                          settingNode; settingNode = settingNode->NextSibling()) {
-                        tinyxml2::XMLElement *setting = settingNode->ToElement();
-                        std::string settingName = setting->Attribute("name");
-                        std::string settingValue = setting->Attribute("value");
-                        equipmentSettings[capabilityName][settingName] =
-                           settingValue;
-                     }
-                     PublishSettings(capabilityName);
-                  }
+// [BAUD]accept=<rate>, [BAUD]reject=<rate> or [BAUD]confirmed=<rate>
+void handleBaud(Session &session, std::string_view rsp, std::string_view body) {
+   size_t equals = body.find('=');
+   if (equals == std::string_view::npos) {
+      session.parseError(LineType::CONTROL);
+      LOG_WARNING << "Malformed baud negotiation: " << std::string(rsp);
+      return;
+   }
+   std::string_view answer = body.substr(0, equals);
+   int rate = atoi(std::string(body.substr(equals + 1)).c_str());
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+   BaudNegotiator::Step step;
+   if (answer == "accept") {
+      if (session.baudNegotiator.accepted(rate, now, step)) {
+         applyBaudStep(session, step);
+      }
+   } else if (answer == "reject") {
+      session.baudNegotiator.rejected(rate);
+      LOG_INFO << "MCU on " << session.port() << " rejected " << rate << " baud, staying at " << session.baud();
+   } else if (answer == "confirmed") {
+      if (session.baudNegotiator.confirmed(rate, now, step)) {
+         applyBaudStep(session, step);
+      }
+      if (!session.baudNegotiator.active()) {
+         LOG_INFO << "Negotiated " << session.baud() << " baud on " << session.port();
+      }
+   } else {
+      session.parseError(LineType::CONTROL);
+   }
+}
 
-                  // Store subscribed topics for this capability
-                  tinyxml2::XMLNode *subs = node->FirstChildElement("subscribed_topics");
-                  if (subs) {
-                     if (firstSub) {
-                        subscribedTopics.clear();
-                        firstSub = false;
-                     }
-                     for (tinyxml2::XMLNode *sub = subs->FirstChildElement(
-                        "topic"); sub; sub = sub->NextSibling()) {
-                        tinyxml2::XMLElement *s = sub->ToElement();
-                        std::string subTopicName = s->Attribute("name");
-
-
-                        if (s->Attribute("nodepath")) {
-                           std::string subname = s->Attribute("nodepath");
-                           if (subTopicName == "AMM_HighFrequencyNode_Data") {
-                              subTopicName = "HF_" + subname;
-                           } else {
-                              subTopicName = subname;
-                           }
-                        }
-
-                        if (s->Attribute("map_name")) {
-                           std::string subMapName = s->Attribute("map_name");
-                           subMaps[subTopicName] = subMapName;
-                        }
-
-                        Utility::add_once(subscribedTopics, subTopicName);
-                        LOG_DEBUG << "[" << capabilityName << "][SUBSCRIBE]" << subTopicName;
-                     }
-                  }
+void handleXml(Session &session, std::string_view rsp, std::string_view body) {
+   // MCUs re-send identical capabilities after a reset; there is nothing to do
+   uint64_t hash = contentHash(rsp);
+   if (hash == session.capabilitiesHash) {
+      LOG_DEBUG << "Capabilities from " << session.port() << " unchanged";
+      return;
+   }
 
-                  // Store published topics for this capability
-                  tinyxml2::XMLNode *pubs = node->FirstChildElement("published_topics");
-                  if (pubs) {
-                     if (firstPub) {
-                        publishedTopics.clear();
-                        firstPub = false;
-                     }
+   LOG_INFO << "Received XML via serial";
+   LOG_DEBUG << "\tXML: " << std::string(rsp);
+   tinyxml2::XMLDocument doc(false);
+   doc.Parse(rsp.data(), rsp.size());
+   if (doc.Error()) {
+      session.parseError(LineType::XML);
+      LOG_ERROR << "Malformed XML from " << session.port();
+      return;
+   }
+   tinyxml2::XMLNode *root = doc.FirstChildElement("AMMModuleConfiguration");
 
-                     for (tinyxml2::XMLNode *pub = pubs->FirstChildElement(
-                        "topic"); pub; pub = pub->NextSibling()) {
-                        tinyxml2::XMLElement *p = pub->ToElement();
-                        std::string pubTopicName = p->Attribute("name");
-                        Utility::add_once(publishedTopics, pubTopicName);
-                        LOG_DEBUG << "[" << capabilityName << "][PUBLISH]" << pubTopicName;
-                     }
+   if (root) {
+      session.capabilitiesHash = hash;
+      tinyxml2::XMLNode *mod = root->FirstChildElement("module");
+      tinyxml2::XMLElement *module = mod->ToElement();
+
+      // how many config lines the MCU takes before it acknowledges
+      const char *configWindow = module->Attribute("config_window");
+      if (configWindow) {
+         session.configWindow = atoi(configWindow);
+      }
+
+      // an MCU that echoes keepalives tells us how often it wants them
+      const char *keepalive = module->Attribute("keepalive_ms");
+      if (keepalive) {
+         session.link.enable(std::chrono::milliseconds(atoi(keepalive)));
+      }
+
+      if (session.initializing) {
+         LOG_INFO << "Module is initializing, so we'll publish the Operational Description.";
+
+         std::string module_name = module->Attribute("name");
+         std::string manufacturer = module->Attribute("manufacturer");
+         std::string model = module->Attribute("model");
+         std::string serial_number = module->Attribute("serial_number");
+         std::string module_version = module->Attribute("module_version");
+
+         AMM::OperationalDescription od;
+         od.name(module_name);
+         od.model(model);
+         od.manufacturer(manufacturer);
+         od.serial_number(serial_number);
+         od.module_id(m_uuid);
+         od.module_version(module_version);
+         // const std::string capabilities = AMM::Utility::read_file_to_string("config/tcp_bridge_capabilities.xml");
+         // od.capabilities_schema(capabilities);
+         publish(session, std::move(od));
+
+         // load static config data for serial bridge client module on startup
+         std::transform(model.begin(), model.end(), model.begin(), ::toupper);
+         std::transform(module_name.begin(), module_name.end(), module_name.begin(), ::toupper);
+         session.clientModuleName = module_name;
+         sendConfigInfo(session, model, module_name);
+         session.initializing = false;
+      }
+
+      // the MCU may ask for the binary wire protocol; confirm in text, then switch
+      const char *wireProtocol = module->Attribute("wire_protocol");
+      if (wireProtocol && !strcmp(wireProtocol, "binary") && !session.binaryProtocol) {
+         LOG_INFO << "MCU on " << session.port() << " requested the binary wire protocol";
+         session.switchToBinary(sysPrefix + "WIRE_PROTOCOL=BINARY\n");
+      }
+
+      tinyxml2::XMLNode *caps = mod->FirstChildElement("capabilities");
+
+      if (caps) {
+         // Gather subs and pubs afresh, then only swap in what changed
+         bool firstSub = true;
+         bool anyPub = false;
+         std::shared_ptr<RoutingTable> routes;
+         std::vector<std::string> publishedTopics;
+
+         for (tinyxml2::XMLNode *node = caps->FirstChildElement(
+            "capability"); node; node = node->NextSibling()) {
+            tinyxml2::XMLElement *cap = node->ToElement();
+            std::string capabilityName = cap->Attribute("name");
+
+            tinyxml2::XMLElement *starting_settings = cap->FirstChildElement(
+               "starting_settings");
+            if (starting_settings) {
+               LOG_DEBUG << "Received starting settings";
+               for (tinyxml2::XMLNode *settingNode = starting_settings->FirstChildElement(
+                  "setting"); settingNode; settingNode = settingNode->NextSibling()) {
+                  tinyxml2::XMLElement *setting = settingNode->ToElement();
+                  std::string settingName = setting->Attribute("name");
+                  std::string settingValue = setting->Attribute("value");
+                  LOG_DEBUG << "[" << settingName << "] = " << settingValue;
+               }
+            }
+
+            tinyxml2::XMLElement *configEl =
+               cap->FirstChildElement("configuration");
+            if (configEl) {
+               // republish the settings only if one of them changed
+               bool changed = !session.equipmentSettings.count(capabilityName);
+               std::map<std::string, std::string> &settings = session.equipmentSettings[capabilityName];
+               for (tinyxml2::XMLNode *settingNode =
+                  configEl->FirstChildElement("setting");
+                    settingNode; settingNode = settingNode->NextSibling()) {
+                  tinyxml2::XMLElement *setting = settingNode->ToElement();
+                  std::string settingName = setting->Attribute("name");
+                  std::string settingValue = setting->Attribute("value");
+                  auto current = settings.find(settingName);
+                  if (current == settings.end() || current->second != settingValue) {
+                     settings[settingName] = settingValue;
+                     changed = true;
                   }
                }
+               if (changed) {
+                  PublishSettings(session, capabilityName);
+               }
             }
-         } else {
-            tinyxml2::XMLNode *root = doc.FirstChildElement("AMMModuleStatus");
-            tinyxml2::XMLElement *module = root->FirstChildElement("module")->ToElement();
-            const char *name = module->Attribute("name");
-            std::string nodeName(name);
-
-            tinyxml2::XMLElement *caps = module->FirstChildElement("capabilities");
-            if (caps) {
-               for (tinyxml2::XMLNode *node = caps->FirstChildElement(
-                  "capability"); node; node = node->NextSibling()) {
-                  tinyxml2::XMLElement *cap = node->ToElement();
-                  std::string capabilityName = cap->Attribute("name");
-                  std::string statusVal = cap->Attribute("status");
-
-                  AMM::Status s;
-                  s.module_id(m_uuid);
-                  s.module_name(nodeName);
-                  s.capability(capabilityName);
-
-                  if (statusVal == "OPERATIONAL") {
-                     s.value(AMM::StatusValue::OPERATIONAL);
-                     if (cap->Attribute("message")) {
-                        std::string errorMessage = cap->Attribute("message");
-                        s.message(errorMessage);
-                     } else {
-                     }
-                  } else if (statusVal == "HALTING_ERROR") {
-                     s.value(AMM::StatusValue::INOPERATIVE);
-                     if (cap->Attribute("message")) {
-                        std::string errorMessage = cap->Attribute("message");
-                        s.message(errorMessage);
+
+            // Store subscribed topics for this capability
+            tinyxml2::XMLNode *subs = node->FirstChildElement("subscribed_topics");
+            if (subs) {
+               if (firstSub) {
+                  routes = std::make_shared<RoutingTable>(&session);
+                  firstSub = false;
+               }
+               for (tinyxml2::XMLNode *sub = subs->FirstChildElement(
+                  "topic"); sub; sub = sub->NextSibling()) {
+                  tinyxml2::XMLElement *s = sub->ToElement();
+                  std::string subTopicName = s->Attribute("name");
+                  std::string nodeName = subTopicName;
+                  bool waveform = false;
+
+                  if (s->Attribute("nodepath")) {
+                     nodeName = s->Attribute("nodepath");
+                     if (subTopicName == "AMM_HighFrequencyNode_Data") {
+                        subTopicName = "HF_" + nodeName;
+                        waveform = true;
                      } else {
+                        subTopicName = nodeName;
                      }
-                  } else if (statusVal == "IMPENDING_ERROR") {
-                     s.value(AMM::StatusValue::EXIGENT);
-                     if (cap->Attribute("message")) {
-                        std::string errorMessage = cap->Attribute("message");
-                        s.message(errorMessage);
-                     } else {
+                  }
+
+                  std::string subMapName;
+                  if (s->Attribute("map_name")) {
+                     subMapName = s->Attribute("map_name");
+                  }
 
+                  // optional conflation: at most max_rate values per second,
+                  // skipping changes smaller than deadband
+                  Subscription subscription;
+                  subscription.topic = subTopicName;
+                  subscription.nodeName = nodeName;
+                  subscription.mapName = subMapName;
+                  subscription.waveform = waveform;
+                  if (s->Attribute("max_rate")) {
+                     subscription.maxRate = strtod(s->Attribute("max_rate"), nullptr);
+                  }
+                  if (s->Attribute("deadband")) {
+                     subscription.deadband = strtod(s->Attribute("deadband"), nullptr);
+                  }
+                  if (s->Attribute("value_type")) {
+                     subscription.float32 = !strcmp(s->Attribute("value_type"), "float32");
+                  }
+                  // waveforms: decimate to rate samples/s, block samples per frame
+                  if (s->Attribute("rate")) {
+                     subscription.rate = strtod(s->Attribute("rate"), nullptr);
+                  }
+                  if (s->Attribute("block")) {
+                     subscription.block = strtoul(s->Attribute("block"), nullptr, 10);
+                     if (subscription.block > WaveformSlot::kMaxBlock) {
+                        LOG_WARNING << "[" << capabilityName << "][SUBSCRIBE]" << subTopicName << " block of "
+                                    << subscription.block << " cut to " << WaveformSlot::kMaxBlock << " samples";
                      }
+                  }
+
+                  if (routes->add(subscription, session.routingTable.get())) {
+                     LOG_DEBUG << "[" << capabilityName << "][SUBSCRIBE]" << subTopicName;
                   } else {
-                     LOG_ERROR << "Invalid status value " << statusVal << " for capability " << capabilityName;
+                     LOG_WARNING << "[" << capabilityName << "][SUBSCRIBE]" << subTopicName
+                                 << " is already subscribed, ignoring it";
                   }
-                  mgr->WriteStatus(s);
                }
             }
-         }
-      } else if (!rsp.compare(0, genericTopicPrefix.size(), genericTopicPrefix)) {
-         std::string topic, message, modType, modLocation, modPayload, modInfo;
-         unsigned first = rsp.find("[");
-         unsigned last = rsp.find("]");
-         topic = rsp.substr(first + 1, last - first - 1);
-         message = rsp.substr(last + 1);
-
-         std::list<std::string> tokenList;
-         split(tokenList, message, boost::algorithm::is_any_of(";"), boost::token_compress_on);
-         std::map<std::string, std::string> kvp;
-
-         BOOST_FOREACH(std::string token, tokenList) {
-            size_t sep_pos = token.find_first_of("=");
-            std::string key = token.substr(0, sep_pos);
-            std::string value = (sep_pos == std::string::npos ? "" : token.substr(sep_pos + 1,
-                                                                                  std::string::npos));
-            kvp[key] = value;
-            if (key == "type") {
-               modType = kvp[key];
-            } else if (key == "location") {
-               modLocation = kvp[key];
-            } else if (key == "info") {
-               modInfo = kvp[key];
-            } else if (key == "payload") {
-               modPayload = kvp[key];
+
+            // Store published topics for this capability
+            tinyxml2::XMLNode *pubs = node->FirstChildElement("published_topics");
+            if (pubs) {
+               anyPub = true;
+
+               for (tinyxml2::XMLNode *pub = pubs->FirstChildElement(
+                  "topic"); pub; pub = pub->NextSibling()) {
+                  tinyxml2::XMLElement *p = pub->ToElement();
+                  std::string pubTopicName = p->Attribute("name");
+                  Utility::add_once(publishedTopics, pubTopicName);
+                  LOG_DEBUG << "[" << capabilityName << "][PUBLISH]" << pubTopicName;
+               }
             }
+         }
 
+         if (anyPub && publishedTopics != session.publishedTopics) {
+            session.publishedTopics.swap(publishedTopics);
          }
 
-         if (topic == "AMM_Render_Modification") {
-            AMM::RenderModification renderMod;
-            renderMod.type(modType);
-            renderMod.data(modPayload);
-            //renderMod.location().description(modLocation);
-            mgr->WriteRenderModification(renderMod);
-         } else if (topic == "AMM_Physiology_Modification") {
-            AMM::PhysiologyModification physMod;
-            physMod.type(modType);
-            physMod.data(modPayload);
-            //physMod.location().description(modLocation);
-            mgr->WritePhysiologyModification(physMod);
-         } else if (topic == "AMM_Performance_Assessment") {
-            AMM::Assessment assessment;
-            assessment.comment(modInfo);
-            mgr->WriteAssessment(assessment);
-         } else if (topic == "AMM_Diagnostics_Log_Record") {
-            if (modType == "info") {
-               LOG_INFO << modPayload;
-            } else if (modType == "warning") {
-               LOG_WARNING << modPayload;
-            } else if (modType == "error") {
-               LOG_ERROR << modPayload;
+         if (routes) {
+            if (routes->sameAs(session.routingTable.get())) {
+               LOG_DEBUG << "Subscriptions on " << session.port() << " unchanged";
             } else {
-               LOG_DEBUG << modPayload;
+               LOG_INFO << "Subscriptions on " << session.port() << " changed, " << routes->unchanged()
+                        << " of " << routes->size() << " kept";
+               session.reserveTelemetry(routes->waveformFrameBytes());
+               session.routingTable = routes;
+               routingIndex.update(routes);
             }
-         } else {
-            LOG_DEBUG << "Unknown topic: " << topic;
          }
-      } else {
-         if (!rsp.empty() && rsp != "\r") {
-            LOG_DEBUG << "Serial debug: " << rsp;
+      }
+   } else {
+      tinyxml2::XMLNode *root = doc.FirstChildElement("AMMModuleStatus");
+      if (!root) {
+         session.parseError(LineType::XML);
+         LOG_WARNING << "Unknown XML document from " << session.port();
+         return;
+      }
+      tinyxml2::XMLElement *module = root->FirstChildElement("module")->ToElement();
+      const char *name = module->Attribute("name");
+      std::string nodeName(name);
+
+      tinyxml2::XMLElement *caps = module->FirstChildElement("capabilities");
+      if (caps) {
+         StatusCache::Clock::time_point now = StatusCache::Clock::now();
+         for (tinyxml2::XMLNode *node = caps->FirstChildElement(
+            "capability"); node; node = node->NextSibling()) {
+            tinyxml2::XMLElement *cap = node->ToElement();
+            std::string capabilityName = cap->Attribute("name");
+            const char *statusVal = cap->Attribute("status");
+
+            AMM::StatusValue value;
+            if (!StatusCache::map(statusVal, value)) {
+               LOG_ERROR << "Invalid status value " << (statusVal ? statusVal : "") << " for capability "
+                         << capabilityName;
+               continue;
+            }
+
+            AMM::Status s;
+            s.module_id(m_uuid);
+            s.module_name(nodeName);
+            s.capability(capabilityName);
+            s.value(value);
+            if (cap->Attribute("message")) {
+               s.message(cap->Attribute("message"));
+            }
+
+            // only changes go out right away, the heartbeat repeats the rest
+            session.statusCache.update(s, now, [&session](const AMM::Status &status) {
+               return publish(session, AMM::Status(status));
+            });
+         }
+      }
+   }
+}
+
+// generic [Topic]k=v;k=v
+void handleTopic(Session &session, std::string_view rsp, std::string_view body) {
+   TopicMessage message;
+   if (!TopicMessage::parse(rsp, message)) {
+      session.parseError(LineType::TOPIC);
+      LOG_DEBUG << "Unterminated topic: " << std::string(rsp);
+      return;
+   }
+
+   switch (TopicMessage::lookup(message.topic)) {
+      case InboundTopic::RENDER_MODIFICATION: {
+         AMM::RenderModification renderMod;
+         renderMod.type(std::string(message.type));
+         renderMod.data(std::string(message.payload));
+         //renderMod.location().description(std::string(message.location));
+         publish(session, std::move(renderMod));
+         break;
+      }
+      case InboundTopic::PHYSIOLOGY_MODIFICATION: {
+         AMM::PhysiologyModification physMod;
+         physMod.type(std::string(message.type));
+         physMod.data(std::string(message.payload));
+         //physMod.location().description(std::string(message.location));
+         publish(session, std::move(physMod));
+         break;
+      }
+      case InboundTopic::PERFORMANCE_ASSESSMENT: {
+         AMM::Assessment assessment;
+         assessment.comment(std::string(message.info));
+         publish(session, std::move(assessment));
+         break;
+      }
+      case InboundTopic::DIAGNOSTICS_LOG_RECORD: {
+         std::string payload(message.payload);
+         if (message.type == "info") {
+            LOG_INFO << payload;
+         } else if (message.type == "warning") {
+            LOG_WARNING << payload;
+         } else if (message.type == "error") {
+            LOG_ERROR << payload;
+         } else {
+            LOG_DEBUG << payload;
          }
+         break;
       }
+      case InboundTopic::UNKNOWN:
+         session.parseError(LineType::TOPIC);
+         LOG_DEBUG << "Unknown topic: " << std::string(message.topic);
+         break;
    }
 }
 
+typedef void (*InboundHandler)(Session &session, std::string_view rsp, std::string_view body);
+
+// Every kind of line the MCU may send. Anything else is debug output.
+constexpr LinePrefix<InboundHandler> inboundPrefixes[] = {
+   {"[REPORT]", LineType::REPORT, &handleReport},
+   {"[AMM_Command]", LineType::COMMAND, &handleCommand},
+   {"[CONFIG_ACK]", LineType::CONTROL, &handleConfigAck},
+   {"[KEEPALIVE]", LineType::CONTROL, &handleKeepalive},
+   {"[BAUD]", LineType::CONTROL, &handleBaud},
+   {"<?xml", LineType::XML, &handleXml},
+   {"[", LineType::TOPIC, &handleTopic},
+};
+
+constexpr PrefixTable<InboundHandler, std::size(inboundPrefixes)> inboundTable(inboundPrefixes);
+static_assert(inboundTable.find("[REPORT]")->type == LineType::REPORT, "longer prefixes must win over [");
+
+// Handles one complete line from the MCU.
+void readHandler(Session &session, std::string_view rsp) {
+   const LinePrefix<InboundHandler> *kind = inboundTable.find(rsp);
+   if (kind) {
+      session.received(kind->type);
+      kind->handler(session, rsp, rsp.substr(kind->prefix.size()));
+   } else if (!rsp.empty() && rsp != "\r") {
+      session.received(LineType::DEBUG);
+      LOG_DEBUG << "Serial debug: " << std::string(rsp);
+   }
+}
+
+
+
+
+
+// Republishes every MCU status that has not changed for a heartbeat period,
+// so modules that join late still learn it. 0 disables the heartbeat.
+std::chrono::seconds statusHeartbeat(30);
 
+// Timed work for every session: baud negotiation, keepalive pings, link loss
+// and status heartbeats. returns when the next of them is due.
+std::chrono::steady_clock::time_point sessionTick(Session &session, std::chrono::steady_clock::time_point now) {
+   BaudNegotiator::Step step;
+   if (session.baudNegotiator.tick(now, step)) {
+      if (step.baud) {
+         LOG_WARNING << "MCU on " << session.port() << " did not confirm the new rate";
+      }
+      applyBaudStep(session, step);
+   }
 
+   std::string ping;
+   if (session.link.ping(now, ping)) {
+      session.transmitPing(ping);
+   }
+   if (session.link.check(now)) {
+      publishLinkStatus(session, now);
+   }
+   std::chrono::steady_clock::time_point next = std::min(session.baudNegotiator.deadline(), session.link.nextDue());
 
+   if (statusHeartbeat.count() <= 0) {
+      return next;
+   }
+   session.statusCache.forEachStale(now, statusHeartbeat, [&session](const AMM::Status &status) {
+      if (!publisher.publish(PublishJob{nullptr, {}, status})) {
+         session.publishDropped();
+         return false;
+      }
+      return true;
+   });
+   return std::min(next, session.statusCache.nextStale(statusHeartbeat));
+}
+
+// Writes the metrics of the publish stage and of every port, one "name value"
+// line each.
+void writeStats(std::ostream &os) {
+   std::shared_ptr<const RoutingIndex::Snapshot> routes = routingIndex.load();
+   os << "publish.depth " << publisher.depth() << "\n";
+   os << "publish.high_water " << publisher.highWater() << "\n";
+   os << "publish.batches " << publisher.batches() << "\n";
+   if (captureLog.active()) {
+      os << "capture.records " << captureLog.records() << "\n";
+      os << "capture.dropped " << captureLog.dropped() << "\n";
+      os << "capture.bytes " << captureLog.bytes() << "\n";
+   }
+   for (auto &session : sessions) {
+      const ReaderStats &in = session->readerStats();
+      const WriterStats &out = session->writerStats();
+
+      os << "port " << session->port() << "\n";
+      os << "  baud " << session->baud() << "\n";
+      os << "  config.failures " << session->configFailures << "\n";
+      os << "  in.bytes " << in.bytes.value() << "\n";
+      os << "  in.lines " << in.lines.value() << "\n";
+      os << "  in.publish_dropped " << in.publishDropped.value() << "\n";
+      os << "  in.missed_deadlines " << in.missedDeadlines.value() << "\n";
+      for (size_t i = 0; i < static_cast<size_t>(LineType::COUNT); ++i) {
+         const char *name = lineTypeName(static_cast<LineType>(i));
+         os << "  in." << name << " " << in.received[i].value() << "\n";
+         os << "  in.parse_errors." << name << " " << in.parseErrors[i].value() << "\n";
+      }
+      os << "  out.frames " << out.frames.value() << "\n";
+      os << "  out.bytes " << out.bytes.value() << "\n";
+      os << "  out.writes " << out.writes.value() << "\n";
+      os << "  out.eagain " << out.eagain.value() << "\n";
+      os << "  out.short_writes " << out.shortWrites.value() << "\n";
+      os << "  out.stalls " << out.stalls.value() << "\n";
+      os << "  out.congestion_drops " << session->congestionDrops() << "\n";
+      os << "  out.write_errors " << session->writeErrors() << "\n";
+      os << "  out.dropped " << session->dropped() << "\n";
+      os << "  out.missed_deadlines " << out.missedDeadlines.value() << "\n";
+      os << "  queue.depth " << session->queueDepth() << "\n";
+      os << "  queue.high_water " << out.highWater.value() << "\n";
+      for (size_t i = 0; i < SerialWriter::kLanes; ++i) {
+         Lane lane = static_cast<Lane>(i);
+         os << "  lane." << laneName(lane) << ".depth " << session->queueDepth(lane) << "\n";
+         os << "  lane." << laneName(lane) << ".dropped " << session->dropped(lane) << "\n";
+         os << "  latency_us.lane." << laneName(lane) << " ";
+         out.laneLatency[i].report(os);
+         os << "\n";
+      }
+      os << "  lane.control.overflow " << session->controlOverflow() << "\n";
 
-void checkForExit() {
-   std::string action;
+      for (auto &table : routes->tables()) {
+         if (table->owner() != session.get()) {
+            continue;
+         }
+         for (auto *group : {&table->routes(), &table->waveforms()}) {
+            for (auto &route : *group) {
+               if (route.second.id < WriterStats::kMaxTopics) {
+                  os << "  topic." << route.first << " " << out.topics[route.second.id].value() << "\n";
+               }
+            }
+         }
+      }
+
+      if (session->link.enabled()) {
+         os << "  link.up " << session->link.up() << "\n";
+         os << "  link.pings " << session->link.sent.value() << "\n";
+         os << "  link.echoes " << session->link.echoed.value() << "\n";
+         os << "  link.missed " << session->link.missed.value() << "\n";
+         os << "  link.jitter_us " << session->link.jitter.value() / 1000.0 << "\n";
+         os << "  link.rate_scale " << session->link.scale.value() / 1000.0 << "\n";
+         os << "  latency_us.rtt ";
+         session->link.rtt.report(os);
+         os << "\n";
+      }
+      os << "  latency_us.dds_to_serial ";
+      out.ddsToSerial.report(os);
+      os << "\n  latency_us.serial_to_dds ";
+      in.serialToDds.report(os);
+      os << "\n  latency_us.stalled ";
+      out.stalled.report(os);
+      os << "\n  latency_us.handle ";
+      in.handle.report(os);
+      os << "\n";
+   }
+}
+
+// Rewrites the stats file every interval; the file is replaced atomically so
+// readers never see a partial dump.
+std::mutex statsLock;
+std::condition_variable statsWake;
+
+void dumpStats(const std::string &path, int intervalSeconds) {
+   std::unique_lock<std::mutex> guard(statsLock);
    while (!closed) {
-      getline(std::cin, action);
+      statsWake.wait_for(guard, std::chrono::seconds(intervalSeconds));
+      std::string tmp = path + ".tmp";
+      {
+         std::ofstream ofs(tmp, std::ios::trunc);
+         writeStats(ofs);
+      }
+      if (rename(tmp.c_str(), path.c_str()) != 0) {
+         LOG_WARNING << "Unable to write stats file " << path;
+      }
+   }
+}
+
+void shutdown(Reactor &reactor) {
+   closed = true;
+   reactor.stop();
+   {
+      std::lock_guard<std::mutex> guard(statsLock);
+   }
+   statsWake.notify_all();
+}
+
+// Commands typed on stdin: EXIT shuts the bridge down, STATS prints the
+// metrics. Called by the reactor whenever stdin is readable.
+std::string consoleInput;
+
+void readConsole(Reactor &reactor) {
+   char buf[256];
+   ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+   if (n <= 0) {
+      if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+         // end of input, e.g. started with stdin redirected
+         reactor.unwatch(STDIN_FILENO);
+      }
+      return;
+   }
+   consoleInput.append(buf, n);
+
+   size_t eol;
+   while ((eol = consoleInput.find('\n')) != std::string::npos) {
+      std::string action = consoleInput.substr(0, eol);
+      consoleInput.erase(0, eol + 1);
       std::transform(action.begin(), action.end(), action.begin(), ::toupper);
+      if (!action.empty() && action.back() == '\r') {
+         action.pop_back();
+      }
       if (action == "EXIT") {
-         closed = true;
          LOG_INFO << "Shutting down.";
+         shutdown(reactor);
+      } else if (action == "STATS") {
+         writeStats(std::cout);
+         std::cout.flush();
       }
    }
 }
 
+void readSignal(Reactor &reactor, int fd) {
+   struct signalfd_siginfo info;
+   if (read(fd, &info, sizeof(info)) == sizeof(info)) {
+      LOG_WARNING << "Interrupt signal (" << info.ssi_signo << ") received.";
+      shutdown(reactor);
+   }
+}
+
+// records handled per wakeup of a replay, so a replay at full speed still
+// lets the loop tick sessions and see EXIT
+const size_t kReplayBatch = 256;
+std::chrono::steady_clock::time_point replayStarted;
+
+void armReplay(int timerFd, std::chrono::steady_clock::time_point when) {
+   auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+   struct itimerspec spec = {};
+   // 0 would disarm the timer
+   ns = std::max<decltype(ns)>(ns, 1);
+   spec.it_value.tv_sec = ns / 1000000000;
+   spec.it_value.tv_nsec = ns % 1000000000;
+   timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+// Feeds the records of the capture that are due to the line handler and the
+// DDS listener, on the first reactor thread. Once the capture is exhausted the
+// metrics are printed and the bridge shuts down.
+void replayCapture(Reactor &reactor, AMMListener &listener, int timerFd) {
+   uint64_t expirations;
+   ssize_t n = read(timerFd, &expirations, sizeof(expirations));
+   (void) n;
+
+   const std::chrono::steady_clock::duration deadline = Realtime::options().deadline;
+   Session *fed = nullptr;
+   CaptureReplay::Record record;
+   size_t played = 0;
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+   while (played < kReplayBatch && replay.next(now, record)) {
+      ++played;
+      switch (record.kind) {
+         case CaptureKind::SERIAL_IN:
+            if (record.port < sessions.size()) {
+               Session &session = *sessions[record.port];
+               std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+               session.replay(record.second, readHandler);
+               session.handled(start, std::chrono::steady_clock::now(), deadline);
+               fed = &session;
+            }
+            break;
+         case CaptureKind::PHYSIOLOGY_VALUE: {
+            AMM::PhysiologyValue value;
+            value.name(std::string(record.first));
+            value.value(record.number());
+            listener.onNewPhysiologyValue(value, nullptr);
+            break;
+         }
+         case CaptureKind::PHYSIOLOGY_WAVEFORM: {
+            AMM::PhysiologyWaveform waveform;
+            waveform.name(std::string(record.first));
+            waveform.value(record.number());
+            listener.onNewPhysiologyWaveform(waveform, nullptr);
+            break;
+         }
+         case CaptureKind::COMMAND: {
+            AMM::Command command;
+            command.message(std::string(record.second));
+            listener.onNewCommand(command, nullptr);
+            break;
+         }
+         case CaptureKind::PHYSIOLOGY_MODIFICATION: {
+            AMM::PhysiologyModification modification;
+            modification.type(std::string(record.first));
+            modification.data(std::string(record.second));
+            listener.onNewPhysiologyModification(modification, nullptr);
+            break;
+         }
+         case CaptureKind::RENDER_MODIFICATION: {
+            AMM::RenderModification modification;
+            modification.type(std::string(record.first));
+            modification.data(std::string(record.second));
+            listener.onNewRenderModification(modification, nullptr);
+            break;
+         }
+         case CaptureKind::SIMULATION_CONTROL: {
+            AMM::SimulationControl control;
+            control.type(static_cast<AMM::ControlType>(record.control()));
+            listener.onNewSimulationControl(control, nullptr);
+            break;
+         }
+         default:
+            // the bridge produces its own output from what it is fed
+            break;
+      }
+   }
+   // the lines may have changed what the sessions wait for; replay runs on a
+   // single shard, so one request ticks them all
+   if (fed) {
+      fed->requestTick();
+   }
+
+   if (replay.finished()) {
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - replayStarted);
+      LOG_INFO << "Replayed " << replay.played() << " records in " << elapsed.count() << " ms";
+      writeStats(std::cout);
+      shutdown(reactor);
+      return;
+   }
+   armReplay(timerFd, played == kReplayBatch ? now : replay.nextDue());
+}
+
 void reset_gpio() {
+   if (!lineMCUEnable) {
+      return;
+   }
    // reset GPIO & release line and chip
    gpiod_line_set_value(lineMCUEnable, true);
    gpiod_line_release(lineMCUEnable);
@@ -545,18 +1107,6 @@ void reset_gpio() {
    gpiod_chip_close(chip);
 }
 
-void signalHandler(int signum) {
-   LOG_WARNING << "Interrupt signal (" << signum << ") received.";
-
-   if (signum == 15) {
-      serialport_close(fd);
-      LOG_INFO << "Shutdown complete";
-   }
-   reset_gpio();
-   exit(signum);
-}
-
-
 void PublishOperationalDescription() {
    AMM::OperationalDescription od;
    od.name(moduleName);
@@ -586,8 +1136,25 @@ void PublishConfiguration() {
 static void show_usage(const std::string &name) {
    std::cerr << "Usage: " << name << " <option(s)>"
              << "\nOptions:\n" << std::endl
-             << "\t-p Linux COM port (defaults to " << PORT_LINUX << ")" << std::endl
-             << "\t-b COM port baud rate (defaults to " << BAUD << ")" << std::endl
+             << "\t-p Linux COM port, repeat to bridge several ports (defaults to " << PORT_LINUX << ")" << std::endl
+             << "\t-b COM port baud rate, any rate up to 4000000 (defaults to " << BAUD << ")" << std::endl
+             << "\t-n Negotiate the baud rate with the MCU up to this rate (off by default)" << std::endl
+             << "\t-r MCU receive budget in bytes/s (defaults to the baud rate)" << std::endl
+             << "\t-q Frames the control, modification and telemetry lanes may hold, e.g. 64,1024,1024 (the defaults)" << std::endl
+             << "\t-g Gap between transmitted frames in microseconds (defaults to 0)" << std::endl
+             << "\t-t Number of reactor threads serving the ports (defaults to 1)" << std::endl
+             << "\t-u Seconds between status heartbeats, 0 to only publish changes (defaults to 30)" << std::endl
+             << "\t-s File to dump metrics to periodically (type STATS on stdin to print them)" << std::endl
+             << "\t-i Seconds between metrics dumps (defaults to 10)" << std::endl
+             << "\t--realtime Run serial I/O under SCHED_FIFO, lock memory and tune the ports for latency" << std::endl
+             << "\t--rt-priority SCHED_FIFO priority of the serial I/O threads (defaults to 50)" << std::endl
+             << "\t--io-cpus CPUs to pin the serial I/O threads to, e.g. 2,3 (defaults to any)" << std::endl
+             << "\t--worker-cpus CPUs to pin the DDS worker threads to, e.g. 0-1 (defaults to any)" << std::endl
+             << "\t--deadline-us Handling time past which a wakeup counts as a missed deadline (defaults to 1000)" << std::endl
+             << "\t--capture Record serial traffic and DDS samples to this file" << std::endl
+             << "\t--capture-mb Size the capture file is preallocated to in MiB (defaults to 256)" << std::endl
+             << "\t--replay Play a capture back through the bridge instead of live serial input and DDS samples" << std::endl
+             << "\t--replay-speed Replay speed factor, or max for as fast as possible (defaults to 1)" << std::endl
              << "\t-h,--help\t\tShow this help message\n"
              << std::endl;
 }
@@ -597,8 +1164,18 @@ int main(int argc, char *argv[]) {
    plog::init(plog::verbose, &consoleAppender);
 
    LOG_INFO << "Linux Serial_Bridge starting up";
-   std::string sPort = PORT_LINUX;
+   std::vector<std::string> ports;
    int baudRate = BAUD;
+   int reactorThreads = 1;
+   int rxBudget = 0;
+   int frameGap = 0;
+   SerialWriter::Caps laneCaps;
+   std::string statsFile;
+   int statsInterval = 10;
+   std::string captureFile;
+   size_t captureMb = 256;
+   std::string replayFile;
+   double replaySpeed = 1;
 
 
    for (int i = 1; i < argc; ++i) {
@@ -610,7 +1187,153 @@ int main(int argc, char *argv[]) {
 
       if (arg == "-b") {
          if (i + 1 < argc) {
-            baudRate = stoi(argv[i++]);
+            baudRate = stoi(argv[++i]);
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "-n") {
+         if (i + 1 < argc) {
+            negotiateBaud = stoi(argv[++i]);
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "-r") {
+         if (i + 1 < argc) {
+            rxBudget = stoi(argv[++i]);
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "-q") {
+         int control, modification, telemetry;
+         if (i + 1 < argc && sscanf(argv[i + 1], "%d,%d,%d", &control, &modification, &telemetry) == 3 &&
+             control > 0 && modification > 0 && telemetry > 0) {
+            laneCaps.frames[static_cast<size_t>(Lane::CONTROL)] = control;
+            laneCaps.frames[static_cast<size_t>(Lane::MODIFICATION)] = modification;
+            laneCaps.frames[static_cast<size_t>(Lane::TELEMETRY)] = telemetry;
+            ++i;
+         } else {
+            LOG_ERROR << arg << " option requires three frame counts.";
+            return 1;
+         }
+      }
+
+      if (arg == "-g") {
+         if (i + 1 < argc) {
+            frameGap = stoi(argv[++i]);
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "-t") {
+         if (i + 1 < argc) {
+            reactorThreads = stoi(argv[++i]);
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "-u") {
+         if (i + 1 < argc) {
+            statusHeartbeat = std::chrono::seconds(stoi(argv[++i]));
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "-s") {
+         if (i + 1 < argc) {
+            statsFile = argv[++i];
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "--realtime") {
+         Realtime::options().enabled = true;
+      }
+
+      if (arg == "--rt-priority") {
+         if (i + 1 < argc) {
+            Realtime::options().priority = stoi(argv[++i]);
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "--io-cpus" || arg == "--worker-cpus") {
+         std::vector<int> &cpus = arg == "--io-cpus" ? Realtime::options().ioCpus : Realtime::options().workerCpus;
+         if (i + 1 < argc && Realtime::parseCpus(argv[i + 1], cpus)) {
+            ++i;
+         } else {
+            LOG_ERROR << arg << " option requires a CPU list.";
+            return 1;
+         }
+      }
+
+      if (arg == "--deadline-us") {
+         if (i + 1 < argc) {
+            Realtime::options().deadline = std::chrono::microseconds(stoi(argv[++i]));
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "--capture") {
+         if (i + 1 < argc) {
+            captureFile = argv[++i];
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "--capture-mb") {
+         if (i + 1 < argc) {
+            captureMb = std::max(1, stoi(argv[++i]));
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "--replay") {
+         if (i + 1 < argc) {
+            replayFile = argv[++i];
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "--replay-speed") {
+         if (i + 1 < argc) {
+            std::string speed = argv[++i];
+            replaySpeed = speed == "max" ? 0 : std::max(0.0, stod(speed));
+         } else {
+            LOG_ERROR << arg << " option requires one argument.";
+            return 1;
+         }
+      }
+
+      if (arg == "-i") {
+         if (i + 1 < argc) {
+            statsInterval = std::max(1, stoi(argv[++i]));
          } else {
             LOG_ERROR << arg << " option requires one argument.";
             return 1;
@@ -619,7 +1342,7 @@ int main(int argc, char *argv[]) {
 
       if (arg == "-p") {
          if (i + 1 < argc) {
-            sPort = argv[i++];
+            ports.push_back(argv[++i]);
          } else {
             LOG_ERROR << arg << " option requires one argument.";
             return 1;
@@ -627,13 +1350,31 @@ int main(int argc, char *argv[]) {
       }
    }
 
-   const int buf_max = 8192;
-   char serialport[40];
-   char eolchar = '\n';
-   int timeout = 500;
-   char buf[buf_max];
-   strcpy(serialport, sPort.c_str());
-
+   if (ports.empty()) {
+      ports.push_back(PORT_LINUX);
+   }
+   if (!captureFile.empty() && !replayFile.empty()) {
+      LOG_ERROR << "--capture and --replay can't be combined.";
+      return 1;
+   }
+   if (!replayFile.empty()) {
+      if (!replay.open(replayFile.c_str())) {
+         LOG_ERROR << "Unable to read capture " << replayFile;
+         return 1;
+      }
+      if (reactorThreads != 1) {
+         // the replay feeds every port from the first reactor thread
+         LOG_WARNING << "Replaying on a single reactor thread";
+         reactorThreads = 1;
+      }
+   }
+   if (!captureFile.empty()) {
+      if (!captureLog.open(captureFile.c_str(), captureMb << 20)) {
+         LOG_ERROR << "Unable to create capture " << captureFile << ": " << strerror(errno);
+         exit(EXIT_FAILURE);
+      }
+      LOG_INFO << "Capturing to " << captureFile;
+   }
    mgr->InitializeCommand();
    mgr->InitializeInstrumentData();
    mgr->InitializeSimulationControl();
@@ -641,6 +1382,7 @@ int main(int argc, char *argv[]) {
    mgr->InitializeRenderModification();
    mgr->InitializeAssessment();
    mgr->InitializePhysiologyValue();
+   mgr->InitializePhysiologyWaveform();
 
    mgr->InitializeOperationalDescription();
    mgr->InitializeModuleConfiguration();
@@ -650,15 +1392,6 @@ int main(int argc, char *argv[]) {
    mgr->CreateModuleConfigurationPublisher();
    mgr->CreateStatusPublisher();
 
-   AMMListener tl;
-
-   mgr->CreatePhysiologyValueSubscriber(&tl, &AMMListener::onNewPhysiologyValue);
-   //mgr->CreatePhysiologyWaveformSubscriber(&tl, &AMMListener::onNewPhysiologyWaveform);
-   mgr->CreateCommandSubscriber(&tl, &AMMListener::onNewCommand);
-   mgr->CreateRenderModificationSubscriber(&tl, &AMMListener::onNewRenderModification);
-   mgr->CreatePhysiologyModificationSubscriber(&tl, &AMMListener::onNewPhysiologyModification);
-   mgr->CreateSimulationControlSubscriber(&tl, &AMMListener::onNewSimulationControl);
-
    mgr->CreateRenderModificationPublisher();
    mgr->CreatePhysiologyModificationPublisher();
    mgr->CreateCommandPublisher();
@@ -668,55 +1401,119 @@ int main(int argc, char *argv[]) {
 
    std::this_thread::sleep_for(std::chrono::milliseconds(250));
 
-   // open GPIO chip
+   // open GPIO chip; hosts without one (e.g. a PTY test rig) run without the enable line
    chip = gpiod_chip_open_by_name(chipname);
-   // configure GPIO line
-   lineMCUEnable = gpiod_chip_get_line(chip, MCU_ENABLE_LINE);
-   gpiod_line_request_output(lineMCUEnable, "serial bridge enable", 1);
-   gpiod_line_set_value(lineMCUEnable, false);
+   if (chip) {
+      // configure GPIO line
+      lineMCUEnable = gpiod_chip_get_line(chip, MCU_ENABLE_LINE);
+      gpiod_line_request_output(lineMCUEnable, "serial bridge enable", 1);
+      gpiod_line_set_value(lineMCUEnable, false);
+   } else {
+      LOG_WARNING << "No GPIO chip " << chipname << ", MCU enable line not driven";
+   }
 
    // PublishOperationalDescription();
    // PublishConfiguration();
 
-   std::thread ec(checkForExit);
+   if (Realtime::options().enabled) {
+      Realtime::lockMemory();
+      LOG_INFO << "Realtime mode: serial I/O at SCHED_FIFO priority " << Realtime::options().priority;
+   }
+
+   TransmitScheduler scheduler(baudRate, rxBudget, std::chrono::microseconds(frameGap));
+   Reactor reactor(reactorThreads, readHandler, sessionTick);
 
-   fd = serialport_init(serialport, baudRate);
-   if (fd == -1) {
-      LOG_ERROR << "Unable to open serial port " << serialport;
+   for (const std::string &port : ports) {
+      std::unique_ptr<Session> session(new Session(port, baudRate, scheduler, laneCaps));
+      if (captureLog.active()) {
+         session->capture(&captureLog, static_cast<uint8_t>(sessions.size()));
+      }
+      if (!session->open(Realtime::options().enabled)) {
+         LOG_ERROR << "Unable to open serial port " << port;
+         exit(EXIT_FAILURE);
+      }
+      // while replaying, what the MCU sends comes from the capture
+      if (!reactor.add(*session, replayFile.empty())) {
+         LOG_ERROR << "Unable to watch serial port " << port;
+         exit(EXIT_FAILURE);
+      }
+      if (negotiateBaud > baudRate) {
+         session->baudNegotiator.start(baudRate, negotiateBaud, std::chrono::steady_clock::now());
+      }
+      LOG_INFO << "Opened port " << port << " at " << baudRate << " baud";
+      sessions.push_back(std::move(session));
+   }
+//    serialport_flush(fd);
+
+   AMMListener tl;
+
+   // The listener walks the session list from DDS threads, so it subscribes
+   // only once the list is complete; a replay stands in for the live samples.
+   if (replayFile.empty()) {
+      mgr->CreatePhysiologyValueSubscriber(&tl, &AMMListener::onNewPhysiologyValue);
+      mgr->CreatePhysiologyWaveformSubscriber(&tl, &AMMListener::onNewPhysiologyWaveform);
+      mgr->CreateCommandSubscriber(&tl, &AMMListener::onNewCommand);
+      mgr->CreateRenderModificationSubscriber(&tl, &AMMListener::onNewRenderModification);
+      mgr->CreatePhysiologyModificationSubscriber(&tl, &AMMListener::onNewPhysiologyModification);
+      mgr->CreateSimulationControlSubscriber(&tl, &AMMListener::onNewSimulationControl);
+   }
+
+   int signalFd = signalfd(-1, &shutdownSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+   if (signalFd < 0 || !reactor.watch(signalFd, [&reactor, signalFd] { readSignal(reactor, signalFd); })) {
+      LOG_ERROR << "Unable to watch for shutdown signals";
       exit(EXIT_FAILURE);
    }
+   if (!reactor.watch(STDIN_FILENO, [&reactor] { readConsole(reactor); })) {
+      LOG_DEBUG << "stdin can't be watched, console commands disabled";
+   }
 
-   LOG_INFO << "Opened port " << serialport;
-//    serialport_flush(fd);
+   LOG_INFO << "Serial_Bridge ready, serving " << sessions.size() << " port(s) on "
+            << reactor.shards() << " thread(s)";
 
-   signal(SIGINT, signalHandler);
-   signal(SIGTERM, signalHandler);
+   std::thread statsDumper;
+   if (!statsFile.empty()) {
+      statsDumper = std::thread(dumpStats, statsFile, statsInterval);
+   }
 
-   LOG_INFO << "Serial_Bridge ready";
+   publisher.start();
+   LOG_INFO << "Cached " << configCache.load() << " static config file(s)";
+   conflator.start();
 
-   while (!closed) {
-      memset(buf, 0, buf_max);  //
-      serialport_read_until(fd, buf, eolchar, buf_max, timeout);
-      //        LOG_DEBUG << "Read in string: " << buf;
-      globalInboundBuffer += buf;
-      readHandler();
-
-      while (!transmitQ.empty()) {
-         std::string sendStr = transmitQ.front();
-         // LOG_DEBUG << "Writing from transmitQ: " << sendStr;
-         rc = serialport_write(fd, sendStr.c_str());
-         if (rc == -1) {
-            LOG_ERROR << " Error writing to serial port";
-         }
-         transmitQ.pop();
-         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+   if (!replayFile.empty()) {
+      int replayFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (replayFd < 0 || !reactor.watch(replayFd, [&reactor, &tl, replayFd] { replayCapture(reactor, tl, replayFd); })) {
+         LOG_ERROR << "Unable to start replaying " << replayFile;
+         exit(EXIT_FAILURE);
+      }
+      replayStarted = std::chrono::steady_clock::now();
+      replay.start(replaySpeed, replayStarted);
+      armReplay(replayFd, replayStarted);
+      if (replaySpeed > 0) {
+         LOG_INFO << "Replaying " << replayFile << " at " << replaySpeed << "x";
+      } else {
+         LOG_INFO << "Replaying " << replayFile << " as fast as possible";
       }
    }
 
-   serialport_close(fd);
-   reset_gpio();
+   reactor.run();
 
-   ec.join();
+   conflator.stop();
+   publisher.stop();
+   if (statsDumper.joinable()) {
+      {
+         std::lock_guard<std::mutex> guard(statsLock);
+      }
+      statsWake.notify_all();
+      statsDumper.join();
+   }
+   for (auto &session : sessions) {
+      session->close();
+   }
+   if (captureLog.active()) {
+      LOG_INFO << "Captured " << captureLog.records() << " records, " << captureLog.dropped() << " dropped";
+      captureLog.close();
+   }
+   reset_gpio();
 
    exit(EXIT_SUCCESS);
 }
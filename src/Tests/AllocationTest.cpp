@@ -0,0 +1,202 @@
+#include <pty.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "Bridge/binary-protocol.h"
+#include "Bridge/message-format.h"
+#include "Serial/serial-writer.h"
+
+// Outbound formatting must not allocate at steady state.
+//
+// Replaces the global operator new with a counting one, then pushes values,
+// waveform blocks, modifications and commands through acquire, format and
+// submit on a serial writer whose port is a PTY, in both wire protocols. Once
+// the pools have warmed up, no thread may allocate.
+
+std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+   allocations.fetch_add(1, std::memory_order_relaxed);
+   if (void *p = std::malloc(size ? size : 1)) {
+      return p;
+   }
+   throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+   return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+   allocations.fetch_add(1, std::memory_order_relaxed);
+   return std::malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+   return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept {
+   std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+   std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+   std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+   std::free(p);
+}
+
+using namespace std::chrono;
+
+// enough rounds to cycle every pooled frame of both per-sample lanes
+const int kWarmup = 600;
+const int kRounds = 2000;
+
+// the MCU side of the PTY, read so the writer never stalls
+std::atomic<bool> reading{true};
+
+void drain(int master) {
+   char buf[4096];
+   while (reading) {
+      struct pollfd pfd = {master, POLLIN, 0};
+      if (poll(&pfd, 1, 10) > 0) {
+         ssize_t n = read(master, buf, sizeof(buf));
+         (void) n;
+      }
+   }
+}
+
+void waitIdle(SerialWriter &writer) {
+   while (writer.depth() > 0) {
+      std::this_thread::sleep_for(microseconds(100));
+   }
+}
+
+// one round of every outbound message kind; on a binary link values and
+// waveforms go out as packets and the writer wraps the text lines
+void round(SerialWriter &writer, bool binary, const std::string &prefix, const WaveformBlock &block,
+           const std::string &type, const std::string &payload, const std::string &command, int i) {
+   Frame *frame = writer.acquire(Lane::TELEMETRY);
+   if (frame) {
+      if (binary) {
+         BinaryProtocol::value(*frame, 7, i * 0.25, false);
+         frame->binary = true;
+      } else {
+         MessageFormat::value(*frame, prefix, i * 0.25);
+      }
+      writer.submit(frame);
+   }
+   frame = writer.acquire(Lane::TELEMETRY);
+   if (frame) {
+      if (binary) {
+         BinaryProtocol::waveform(*frame, 8, block);
+         frame->binary = true;
+      } else {
+         MessageFormat::waveform(*frame, "[HF_ECG]", block);
+      }
+      writer.submit(frame);
+   }
+   frame = writer.acquire(Lane::MODIFICATION);
+   if (frame) {
+      MessageFormat::modification(*frame, MessageFormat::kPhysiologyModificationPrefix, type, payload);
+      writer.submit(frame);
+   }
+   frame = writer.acquire(Lane::CONTROL);
+   if (frame) {
+      MessageFormat::command(*frame, command);
+      writer.submit(frame);
+   }
+}
+
+// allocations in kRounds rounds once warmed up, in the given wire protocol
+uint64_t measure(bool binary) {
+   int master, slave;
+   if (openpty(&master, &slave, nullptr, nullptr, nullptr) != 0) {
+      std::perror("openpty");
+      std::exit(EXIT_FAILURE);
+   }
+   struct termios tio;
+   tcgetattr(slave, &tio);
+   cfmakeraw(&tio);
+   tcsetattr(slave, TCSANOW, &tio);
+   reading = true;
+   std::thread reader(drain, master);
+
+   SerialWriter writer;
+   writer.start(slave, TransmitScheduler(4000000));
+   if (binary) {
+      Frame *frame = writer.acquire(Lane::CONTROL);
+      frame->data.assign("[SYS]WIRE_PROTOCOL=BINARY\n");
+      frame->topic = Frame::kProtocolTopic;
+      writer.submit(frame);
+   }
+
+   const std::string prefix = "[AMM_Node_Data]Cardiovascular_HeartRate=";
+   WaveformBlock block;
+   block.start = 123456;
+   block.interval = 2000;
+   for (int i = 0; i < 16; ++i) {
+      block.samples.push_back(i * 0.1);
+   }
+   const std::string type = "Hemorrhage";
+   const std::string payload = "<Location>LeftLeg</Location><Severity>0.5</Severity>";
+   const std::string command = "START_SIM";
+
+   for (int i = 0; i < kWarmup; ++i) {
+      round(writer, binary, prefix, block, type, payload, command, i);
+      if (i % 64 == 0) {
+         waitIdle(writer);
+      }
+   }
+   waitIdle(writer);
+
+   uint64_t before = allocations.load();
+   for (int i = 0; i < kRounds; ++i) {
+      round(writer, binary, prefix, block, type, payload, command, i);
+      if (i % 64 == 0) {
+         waitIdle(writer);
+      }
+   }
+   waitIdle(writer);
+   uint64_t counted = allocations.load() - before;
+
+   writer.stop();
+   reading = false;
+   reader.join();
+   close(master);
+   close(slave);
+   return counted;
+}
+
+int main() {
+   int failures = 0;
+   for (bool binary : {false, true}) {
+      uint64_t counted = measure(binary);
+      std::printf("%s protocol: %llu allocations in %d rounds\n", binary ? "binary" : "text",
+                  static_cast<unsigned long long>(counted), kRounds);
+      if (counted != 0) {
+         ++failures;
+      }
+   }
+   if (failures) {
+      std::fprintf(stderr, "FAIL: outbound formatting allocated\n");
+      return EXIT_FAILURE;
+   }
+   std::printf("allocation: OK\n");
+   return EXIT_SUCCESS;
+}
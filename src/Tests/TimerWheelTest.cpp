@@ -0,0 +1,141 @@
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+
+#include "amm_std.h"
+
+#include "Bridge/reactor.h"
+#include "Bridge/timer-wheel.h"
+
+// Timer wheel and reactor timing.
+//
+// An entry must never fire before it is due, wherever its due time falls
+// within a tick, and a session whose tick is woken early or swept from
+// another thread must stay on the wheel and keep ticking on schedule.
+
+using namespace std::chrono;
+
+typedef steady_clock Clock;
+
+int failures = 0;
+
+#define EXPECT(cond, ...) \
+   do { \
+      if (!(cond)) { \
+         std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+         std::fprintf(stderr, __VA_ARGS__); \
+         std::fprintf(stderr, "\n"); \
+         ++failures; \
+      } \
+   } while (0)
+
+// advances in steps that do not line up with the tick and checks every entry
+// fires no earlier than it was due and within a tick of the step that covers it
+void neverEarly() {
+   Clock::time_point origin = Clock::now();
+   TimerWheel<Clock::time_point> wheel(origin);
+   std::mt19937 random(7);
+   std::uniform_int_distribution<int> offset(0, 300000);
+
+   const int kEntries = 20000;
+   for (int i = 0; i < kEntries; ++i) {
+      Clock::time_point due = origin + microseconds(offset(random));
+      wheel.schedule(due, due);
+   }
+
+   int fired = 0;
+   int early = 0;
+   for (Clock::time_point now = origin; wheel.size() > 0; now += microseconds(500)) {
+      wheel.advance(now, [&](Clock::time_point due, Clock::time_point at) {
+         ++fired;
+         if (due > at) {
+            ++early;
+         }
+      });
+   }
+   EXPECT(fired == kEntries, "%d of %d entries fired", fired, kEntries);
+   EXPECT(early == 0, "%d entries fired early", early);
+
+   // the case that used to fire a tick early: due mid-tick, advanced to just
+   // past the start of that tick
+   TimerWheel<int> single(origin);
+   bool hit = false;
+   single.schedule(origin + microseconds(5700), 1);
+   single.advance(origin + microseconds(5200), [&hit](int, Clock::time_point) { hit = true; });
+   EXPECT(!hit, "entry due at 5700us fired at 5200us");
+   single.advance(origin + microseconds(6000), [&hit](int, Clock::time_point) { hit = true; });
+   EXPECT(hit, "entry due at 5700us did not fire at 6000us");
+}
+
+// A session that is never read asks for a tick every 2.7 ms, so its due times
+// fall mid-tick. Another thread sweeps it for a while, then only wakes the
+// loop through an unrelated fd, as stdin or another port would, at times that
+// fall just before the session is due. From then on only the wheel can bring
+// its ticks, and it has to keep doing so.
+void sessionKeepsTicking() {
+   const microseconds kPeriod(2700);
+   const milliseconds kSweeping(50);
+   const milliseconds kQuiet(250);
+
+   TransmitScheduler scheduler(115200, 0, microseconds(0));
+   Session session("/dev/null", 115200, scheduler);
+
+   Clock::time_point quietFrom = Clock::now() + kSweeping;
+   int quietTicks = 0;
+   Clock::time_point due = Clock::time_point::min();
+   Reactor reactor(1, [](Session &, std::string_view) {}, [&](Session &, Clock::time_point now) {
+      // a sweep before the session is due leaves its due time alone
+      if (now >= due) {
+         if (now >= quietFrom) {
+            ++quietTicks;
+         }
+         due = now + kPeriod;
+      }
+      return due;
+   });
+   EXPECT(reactor.add(session, false), "session not added");
+   int other = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   EXPECT(reactor.watch(other, [other] {
+      uint64_t count;
+      ssize_t n = read(other, &count, sizeof(count));
+      (void) n;
+   }), "eventfd not watched");
+
+   std::thread driver([&] {
+      while (Clock::now() < quietFrom) {
+         std::this_thread::sleep_for(microseconds(1300));
+         session.requestTick();
+      }
+      while (Clock::now() < quietFrom + kQuiet) {
+         std::this_thread::sleep_for(microseconds(300));
+         uint64_t one = 1;
+         ssize_t n = write(other, &one, sizeof(one));
+         (void) n;
+      }
+      reactor.stop();
+   });
+   reactor.run();
+   driver.join();
+   close(other);
+
+   int expected = static_cast<int>(kQuiet / kPeriod);
+   EXPECT(quietTicks >= expected * 8 / 10 && quietTicks <= expected + 1,
+          "%d ticks in %lld ms without sweeps, expected about %d", quietTicks,
+          static_cast<long long>(kQuiet.count()), expected);
+}
+
+int main() {
+   neverEarly();
+   sessionKeepsTicking();
+   if (failures) {
+      std::fprintf(stderr, "%d failure(s)\n", failures);
+      return EXIT_FAILURE;
+   }
+   std::printf("timer wheel: OK\n");
+   return EXIT_SUCCESS;
+}
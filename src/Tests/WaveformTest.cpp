@@ -0,0 +1,130 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "amm_std.h"
+
+#include "Bridge/binary-protocol.h"
+#include "Bridge/conflation.h"
+#include "Bridge/message-format.h"
+#include "Bridge/waveform.h"
+
+// Waveform block sizing and expiry.
+//
+// The block an MCU asks for must be honoured up to kMaxBlock and fit the frame
+// size the slot reports, and a block that stays short must still go out once
+// it has waited for maxAge(), but never a second time.
+
+using namespace std::chrono;
+
+typedef WaveformSlot::Clock Clock;
+
+int failures = 0;
+
+#define EXPECT(cond, ...) \
+   do { \
+      if (!(cond)) { \
+         std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+         std::fprintf(stderr, __VA_ARGS__); \
+         std::fprintf(stderr, "\n"); \
+         ++failures; \
+      } \
+   } while (0)
+
+WireTopic topic(const std::string &prefix) {
+   WireTopic wire;
+   wire.prefix = prefix;
+   wire.id = 3;
+   return wire;
+}
+
+// a full block of the widest samples, wrapped in a TEXT packet as on a binary
+// link, is no larger than frameBytes()
+void blockFitsItsFrame() {
+   WaveformSlot slot(nullptr, topic("[HF_" + std::string(40, 'X') + "]"), 0, 100);
+   EXPECT(slot.block() == WaveformSlot::kMaxBlock, "block of 100 became %zu", slot.block());
+
+   WaveformBlock block;
+   Clock::time_point now = Clock::now();
+   size_t offered = 0;
+   while (slot.offer(-1.23457e-05, now, block) != WaveformSlot::Offer::FULL) {
+      now += microseconds(2000);
+      ++offered;
+   }
+   EXPECT(offered + 1 == WaveformSlot::kMaxBlock, "full after %zu samples", offered + 1);
+
+   Frame text;
+   MessageFormat::waveform(text, slot.wire.prefix, block);
+   std::string packet;
+   BinaryProtocol::PacketWriter writer(packet, BinaryProtocol::TEXT);
+   writer.put(text.data.data(), text.data.size() - 1);
+   writer.finish();
+   EXPECT(packet.size() <= slot.frameBytes(), "%zu byte packet, %zu reserved", packet.size(), slot.frameBytes());
+}
+
+void shortBlockExpires() {
+   std::mutex lock;
+   std::vector<size_t> sent;
+   Conflator conflator([](Session *, const WireTopic &, double) {},
+                       [&](Session *, const WireTopic &, const WaveformBlock &block) {
+                          std::lock_guard<std::mutex> guard(lock);
+                          sent.push_back(block.samples.size());
+                       });
+   conflator.start();
+
+   std::shared_ptr<WaveformSlot> slot = std::make_shared<WaveformSlot>(nullptr, topic("[HF_ECG]"), 0, 10);
+   EXPECT(slot->maxAge() == WaveformSlot::kDefaultMaxAge, "max age %lld ms",
+          static_cast<long long>(duration_cast<milliseconds>(slot->maxAge()).count()));
+
+   // three samples, then the source stops
+   WaveformBlock block;
+   Clock::time_point now = Clock::now();
+   EXPECT(slot->offer(1, now, block) == WaveformSlot::Offer::STARTED, "first sample did not start a block");
+   conflator.expire(slot, now + slot->maxAge());
+   EXPECT(slot->offer(2, now, block) == WaveformSlot::Offer::KEPT, "second sample not kept");
+   EXPECT(slot->offer(3, now, block) == WaveformSlot::Offer::KEPT, "third sample not kept");
+
+   std::this_thread::sleep_for(slot->maxAge() / 2);
+   {
+      std::lock_guard<std::mutex> guard(lock);
+      EXPECT(sent.empty(), "block sent after half its max age");
+   }
+   std::this_thread::sleep_for(slot->maxAge());
+   {
+      std::lock_guard<std::mutex> guard(lock);
+      EXPECT(sent.size() == 1 && sent[0] == 3, "%zu blocks sent, expected one of 3 samples", sent.size());
+      sent.clear();
+   }
+
+   // a block that fills before its expiry goes out only once, from offer()
+   now = Clock::now();
+   EXPECT(slot->offer(0, now, block) == WaveformSlot::Offer::STARTED, "no new block");
+   conflator.expire(slot, now + slot->maxAge());
+   for (int i = 1; i < 10; ++i) {
+      WaveformSlot::Offer offer = slot->offer(i, now, block);
+      EXPECT(offer == (i == 9 ? WaveformSlot::Offer::FULL : WaveformSlot::Offer::KEPT), "sample %d", i);
+   }
+   std::this_thread::sleep_for(slot->maxAge() * 3 / 2);
+   {
+      std::lock_guard<std::mutex> guard(lock);
+      EXPECT(sent.empty(), "%zu full blocks sent again on expiry", sent.size());
+   }
+
+   conflator.stop();
+}
+
+int main() {
+   blockFitsItsFrame();
+   shortBlockExpires();
+   if (failures) {
+      std::fprintf(stderr, "%d failure(s)\n", failures);
+      return EXIT_FAILURE;
+   }
+   std::printf("waveform: OK\n");
+   return EXIT_SUCCESS;
+}
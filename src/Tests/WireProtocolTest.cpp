@@ -0,0 +1,206 @@
+#include <pty.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "amm_std.h"
+
+#include "Bridge/binary-protocol.h"
+#include "Bridge/session.h"
+
+// Switching the wire protocol in both directions.
+//
+// The MCU side of a PTY plays an MCU that keeps sending text until it sees the
+// switch to binary, then resets and comes back in text. The bridge has to read
+// every one of its lines, and follow it back to text. The writer on its own
+// must drop binary frames it can no longer send instead of waiting for them.
+
+using namespace std::chrono;
+
+int failures = 0;
+
+#define EXPECT(cond, ...) \
+   do { \
+      if (!(cond)) { \
+         std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+         std::fprintf(stderr, __VA_ARGS__); \
+         std::fprintf(stderr, "\n"); \
+         ++failures; \
+      } \
+   } while (0)
+
+void rawPty(int &master, int &slave, char *name) {
+   if (openpty(&master, &slave, name, nullptr, nullptr) != 0) {
+      std::perror("openpty");
+      std::exit(EXIT_FAILURE);
+   }
+   struct termios tio;
+   tcgetattr(slave, &tio);
+   cfmakeraw(&tio);
+   tcsetattr(slave, TCSANOW, &tio);
+}
+
+void send(int fd, const std::string &bytes) {
+   ssize_t n = write(fd, bytes.data(), bytes.size());
+   (void) n;
+}
+
+// everything that arrives on fd within ms
+std::string receive(int fd, int ms) {
+   std::string got;
+   char buf[4096];
+   steady_clock::time_point end = steady_clock::now() + milliseconds(ms);
+   while (steady_clock::now() < end) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, 10) > 0) {
+         ssize_t n = read(fd, buf, sizeof(buf));
+         if (n > 0) {
+            got.append(buf, n);
+         }
+      }
+   }
+   return got;
+}
+
+std::string textPacket(const std::string &line) {
+   std::string packet;
+   BinaryProtocol::PacketWriter writer(packet, BinaryProtocol::TEXT);
+   writer.put(line.data(), line.size());
+   writer.finish();
+   return packet;
+}
+
+// lines the session hands on within ms
+std::vector<std::string> lines(Session &session, int ms) {
+   std::vector<std::string> got;
+   steady_clock::time_point end = steady_clock::now() + milliseconds(ms);
+   while (steady_clock::now() < end) {
+      std::this_thread::sleep_for(milliseconds(5));
+      session.drain([&got](Session &, std::string_view line) {
+         got.emplace_back(line);
+      });
+   }
+   return got;
+}
+
+void sessionFollowsTheMcu() {
+   int master, slave;
+   char name[64];
+   rawPty(master, slave, name);
+   TransmitScheduler scheduler(4000000, 0, microseconds(0));
+   Session session(name, 4000000, scheduler);
+   EXPECT(session.open(), "unable to open %s", name);
+
+   session.switchToBinary("[SYS]WIRE_PROTOCOL=BINARY\n");
+   std::string confirmation = receive(master, 50);
+   EXPECT(confirmation == "[SYS]WIRE_PROTOCOL=BINARY\n", "switch confirmed as \"%s\"", confirmation.c_str());
+
+   // a text line the MCU sent before it saw the switch, then its first packet
+   send(master, "[REPORT]before\n" + textPacket("[REPORT]after"));
+   std::vector<std::string> got = lines(session, 50);
+   EXPECT(got.size() == 2 && got[0] == "[REPORT]before" && got[1] == "[REPORT]after",
+          "%zu lines across the switch", got.size());
+   EXPECT(session.binaryProtocol, "left binary on a text line sent before the switch");
+
+   session.transmit("[AMM_Command]START_SIM\n", Lane::CONTROL);
+   std::string packet = receive(master, 50);
+   std::string decoded;
+   EXPECT(!packet.empty() && packet.back() == '\0' &&
+          BinaryProtocol::decode(packet.data(), packet.size() - 1, decoded) &&
+          decoded.substr(1) == "[AMM_Command]START_SIM", "command not sent as a packet");
+
+   // the MCU resets and announces itself in text again
+   send(master, "<?xml version=\"1.0\"?><AMMModuleConfiguration/>\n[REPORT]reset\n");
+   got = lines(session, 50);
+   EXPECT(got.size() == 2 && got[0].compare(0, 5, "<?xml") == 0 && got[1] == "[REPORT]reset",
+          "%zu lines after the reset", got.size());
+   EXPECT(!session.binaryProtocol, "still binary after the MCU went back to text");
+
+   session.transmit("[AMM_Command]PAUSE_SIM\n", Lane::CONTROL);
+   std::string line = receive(master, 50);
+   EXPECT(line == "[AMM_Command]PAUSE_SIM\n", "sent \"%s\" after going back to text", line.c_str());
+
+   // and can negotiate binary again
+   session.switchToBinary("[SYS]WIRE_PROTOCOL=BINARY\n");
+   confirmation = receive(master, 50);
+   EXPECT(confirmation == "[SYS]WIRE_PROTOCOL=BINARY\n", "second switch confirmed as \"%s\"",
+          confirmation.c_str());
+
+   session.close();
+   close(master);
+   close(slave);
+}
+
+Frame *textFrame(SerialWriter &writer, Lane lane, const std::string &line, uint16_t topic = Frame::kNoTopic) {
+   Frame *frame = writer.acquire(lane);
+   frame->data.assign(line);
+   frame->topic = topic;
+   return frame;
+}
+
+Frame *binaryFrame(SerialWriter &writer, double value) {
+   Frame *frame = writer.acquire(Lane::TELEMETRY);
+   BinaryProtocol::value(*frame, 1, value, false);
+   frame->binary = true;
+   return frame;
+}
+
+double cpuSeconds() {
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+          (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Everything is queued before the writer starts, so it sees it all at once.
+void writerDropsStaleBinary() {
+   int master, slave;
+   rawPty(master, slave, nullptr);
+   SerialWriter writer;
+
+   // switched to binary and back before the values got their turn
+   writer.submit(textFrame(writer, Lane::CONTROL, "[SYS]WIRE_PROTOCOL=BINARY\n", Frame::kProtocolTopic));
+   writer.submit(binaryFrame(writer, 1));
+   writer.submit(binaryFrame(writer, 2));
+   writer.submit(textFrame(writer, Lane::CONTROL, "", Frame::kTextTopic));
+   writer.submit(textFrame(writer, Lane::MODIFICATION, "[AMM_Render_Modification]type=A\n"));
+   writer.start(slave, TransmitScheduler(4000000));
+
+   std::string out = receive(master, 50);
+   EXPECT(out == "[SYS]WIRE_PROTOCOL=BINARY\n[AMM_Render_Modification]type=A\n", "wrote %zu bytes: \"%s\"",
+          out.size(), out.c_str());
+   EXPECT(writer.dropped(Lane::TELEMETRY) == 2, "%llu stale binary frames dropped, expected 2",
+          static_cast<unsigned long long>(writer.dropped(Lane::TELEMETRY)));
+
+   // a binary frame with no switch ahead of it must not keep the writer busy
+   double before = cpuSeconds();
+   writer.submit(binaryFrame(writer, 3));
+   out = receive(master, 200);
+   double used = cpuSeconds() - before;
+   EXPECT(out.empty(), "wrote a binary frame to a text MCU");
+   EXPECT(used < 0.1, "writer used %.0f ms of CPU in 200 ms with a binary frame it cannot send", used * 1000);
+   EXPECT(writer.depth() == 0, "%zu frames left queued", writer.depth());
+
+   writer.stop();
+   close(master);
+   close(slave);
+}
+
+int main() {
+   sessionFollowsTheMcu();
+   writerDropsStaleBinary();
+   if (failures) {
+      std::fprintf(stderr, "%d failure(s)\n", failures);
+      return EXIT_FAILURE;
+   }
+   std::printf("wire protocol: OK\n");
+   return EXIT_SUCCESS;
+}